@@ -16,6 +16,8 @@ my @inc;
 my $lib;
 my @link;
 my $length;
+my $tools   = 0;
+my $cc      = 'cc';
 
 GetOptions(
     debug               => \$debug,
@@ -26,8 +28,21 @@ GetOptions(
     "link=s@"           => \@link,
     "cookielength=s"    => \$length,
     install             => \$install,
+    tools               => \$tools,
+    "cc=s"              => \$cc,
 ) or die usage();
 
+### the companion tools are plain C, and don't need apxs
+if( $tools ) {
+    my @tool = ( $cc, qw[-O2 -Wall -pthread -o cookietrack_logscan],
+                 "$FindBin::Bin/cookietrack_logscan.c" );
+
+    warn "\n\nAbout to run:\n\t@tool\n\n";
+
+    system( @tool ) and die $?;
+    exit 0;
+}
+
 unless( can_run( $apxs ) ) {
     die "Could not find '$apxs' in your path.\n\n" .
         "On Ubuntu/Debian, try 'sudo apt-get install apache2-dev'\n\n" .
@@ -92,6 +107,8 @@ sub usage {
   $me [-i] [--debug] [--lib=foo.c | --lib=foo.o] [--inc /some/dir,..] [--link some_lib]
       [--cookielength NUM] [--apxs /path/to/apxs] [--flags ANY_CUSTOM_APXS=FLAGS]
 
+  $me --tools [--cc /path/to/cc]
+
     \n];
 }
 
@@ -0,0 +1,790 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* cookietrack_logscan - decode mod_cookietrack UIDs from access logs
+ *
+ * Streams access logs in the 'cookietrack' JSON LogFormat (see
+ * test/conf/httpd.conf.base), decodes the UIDs in them and prints when
+ * and from which IPs new UIDs were minted. Every distinct UID is counted
+ * once, no matter how many lines it appears on. Files are mmap'd and split
+ * over threads at line boundaries; fields are found with memchr/memmem,
+ * which libc vectorizes.
+ *
+ * Understands these UID formats:
+ *
+ *   builtin     IP.microtime, e.g. 1.2.3.4.1465936070123456
+ *   legacy      IP.seconds or IP.milliseconds, as older mod_usertrack set
+ *   sequential  base 62 ids from 'CookieUIDGenerator sequential'; these
+ *               carry no time or IP, so the TS and XFF of the earliest line
+ *               they appear on are used. Without -a that is the line that
+ *               minted them; with -a, for ids minted before the log
+ *               started, it's only the first time they were seen.
+ *
+ * Build with 'perl build.pl --tools', or:
+ *
+ *   cc -O2 -pthread -o cookietrack_logscan cookietrack_logscan.c
+ */
+
+#define _GNU_SOURCE             // for memmem
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+#define UID_FIELD   "NoteCookie"        // default field holding the UID
+#define GEN_FIELD   "GeneratedCookie"   // field that is "1" if the UID was minted
+#define TS_FIELD    "TS"                // field holding the request time, in seconds
+#define IP_FIELD    "XFF"               // field holding the client ip(s)
+#define DNT_VALUE   "DNT"               // default CookieDNTValue; never a UID
+
+#define MAX_KEY     64                  // longest ip or uid we keep track of
+#define MAX_THREADS 256
+#define TOP_IPS     20                  // default number of ips to print
+#define SEQ_DIGITS  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+
+// the UID formats we can decode
+typedef enum {
+    FMT_UNKNOWN,
+    FMT_BUILTIN,        // ip.microtime
+    FMT_LEGACY,         // ip.seconds or ip.milliseconds
+    FMT_SEQUENTIAL,     // base 62 id
+    FMT_COUNT
+} uid_format_e;
+
+static const char *format_names[ FMT_COUNT ] = {
+    "unknown", "builtin", "legacy", "sequential"
+};
+
+// a decoded UID
+typedef struct {
+    uid_format_e format;
+    int64_t usec;               // mint time, microseconds since the epoch; 0 if unknown
+    char ip[ MAX_KEY + 1 ];     // ip it was minted for; empty if unknown
+    uint64_t seq;               // id, for sequential UIDs
+} uid_info_t;
+
+// a string keyed counter table, with open addressing
+typedef struct {
+    char key[ MAX_KEY + 1 ];
+    uint64_t count;
+} entry_t;
+
+typedef struct {
+    entry_t *entries;
+    size_t size;                // always a power of 2
+    size_t used;
+} table_t;
+
+// a set of distinct UIDs, with open addressing
+typedef struct {
+    char key[ MAX_KEY + 1 ];    // empty if the slot is free
+    uid_info_t info;
+} uid_entry_t;
+
+typedef struct {
+    uid_entry_t *entries;
+    size_t size;                // always a power of 2
+    size_t used;
+} uid_table_t;
+
+// command line settings
+typedef struct {
+    const char *uid_field;      // "NoteCookie":" etc, as searched for
+    const char *dnt_value;
+    int hourly;                 // bucket first seen per hour, not per day
+    int all;                    // count every UID, not just minted ones
+    int top;                    // ips to print
+    int threads;
+} settings_t;
+
+// per thread work & results
+typedef struct {
+    const char *start;          // the lines to scan
+    const char *end;
+    uid_table_t uids_seen;      // distinct UIDs, with their first sighting
+    uint64_t lines;
+    uint64_t uids;
+} worker_t;
+
+static settings_t settings;
+
+/* ********************************************
+
+    Counter tables
+
+   ******************************************** */
+
+static uint32_t hash_key( const char *key, size_t len )
+{   // FNV-1a, like mod_cookietrack uses
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for( i = 0; i < len; i++ ) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static void table_init( table_t *t, size_t size )
+{
+    t->size    = size;
+    t->used    = 0;
+    t->entries = calloc( size, sizeof(entry_t) );
+
+    if( !t->entries ) {
+        perror( "calloc" );
+        exit( 1 );
+    }
+}
+
+static void table_add( table_t *t, const char *key, size_t len, uint64_t count );
+
+// Double the table when it's 3/4 full
+static void table_grow( table_t *t )
+{
+    table_t bigger;
+    size_t i;
+
+    table_init( &bigger, t->size * 2 );
+
+    for( i = 0; i < t->size; i++ ) {
+        if( t->entries[i].count ) {
+            table_add( &bigger, t->entries[i].key,
+                       strlen( t->entries[i].key ), t->entries[i].count );
+        }
+    }
+
+    free( t->entries );
+    *t = bigger;
+}
+
+static void table_add( table_t *t, const char *key, size_t len, uint64_t count )
+{
+    size_t i;
+
+    if( len > MAX_KEY ) {
+        len = MAX_KEY;
+    }
+
+    if( (t->used + 1) * 4 > t->size * 3 ) {
+        table_grow( t );
+    }
+
+    for( i = hash_key( key, len ) & (t->size - 1); ; i = (i + 1) & (t->size - 1) ) {
+        entry_t *e = &t->entries[i];
+
+        if( !e->count ) {
+            memcpy( e->key, key, len );
+            e->key[len] = '\0';
+            e->count    = count;
+            t->used++;
+            return;
+        }
+
+        if( strncmp( e->key, key, len ) == 0 && e->key[len] == '\0' ) {
+            e->count += count;
+            return;
+        }
+    }
+}
+
+static void uid_table_init( uid_table_t *t, size_t size )
+{
+    t->size    = size;
+    t->used    = 0;
+    t->entries = calloc( size, sizeof(uid_entry_t) );
+
+    if( !t->entries ) {
+        perror( "calloc" );
+        exit( 1 );
+    }
+}
+
+static void uid_table_add( uid_table_t *t, const char *key, size_t len,
+                           const uid_info_t *info );
+
+// Double the table when it's 3/4 full
+static void uid_table_grow( uid_table_t *t )
+{
+    uid_table_t bigger;
+    size_t i;
+
+    uid_table_init( &bigger, t->size * 2 );
+
+    for( i = 0; i < t->size; i++ ) {
+        if( t->entries[i].key[0] ) {
+            uid_table_add( &bigger, t->entries[i].key,
+                           strlen( t->entries[i].key ), &t->entries[i].info );
+        }
+    }
+
+    free( t->entries );
+    *t = bigger;
+}
+
+// Add a UID, or keep the earliest sighting if it's already there. Only
+// sequential UIDs differ between sightings; the others carry their own
+// mint time & ip.
+static void uid_table_add( uid_table_t *t, const char *key, size_t len,
+                           const uid_info_t *info )
+{
+    size_t i;
+
+    if( len > MAX_KEY ) {
+        len = MAX_KEY;
+    }
+
+    if( (t->used + 1) * 4 > t->size * 3 ) {
+        uid_table_grow( t );
+    }
+
+    for( i = hash_key( key, len ) & (t->size - 1); ; i = (i + 1) & (t->size - 1) ) {
+        uid_entry_t *e = &t->entries[i];
+
+        if( !e->key[0] ) {
+            memcpy( e->key, key, len );
+            e->key[len] = '\0';
+            e->info     = *info;
+            t->used++;
+            return;
+        }
+
+        if( strncmp( e->key, key, len ) == 0 && e->key[len] == '\0' ) {
+            if( info->usec && (!e->info.usec || info->usec < e->info.usec) ) {
+                e->info = *info;
+            }
+            return;
+        }
+    }
+}
+
+static void uid_table_merge( uid_table_t *into, uid_table_t *from )
+{
+    size_t i;
+
+    for( i = 0; i < from->size; i++ ) {
+        if( from->entries[i].key[0] ) {
+            uid_table_add( into, from->entries[i].key,
+                           strlen( from->entries[i].key ), &from->entries[i].info );
+        }
+    }
+}
+
+static int by_key( const void *a, const void *b )
+{
+    return strcmp( ((const entry_t *)a)->key, ((const entry_t *)b)->key );
+}
+
+static int by_count( const void *a, const void *b )
+{
+    uint64_t ca = ((const entry_t *)a)->count;
+    uint64_t cb = ((const entry_t *)b)->count;
+
+    return ca < cb ? 1 : ca > cb ? -1 : by_key( a, b );
+}
+
+// Print up to 'max' entries (0 for all), sorted with 'cmp'
+static void table_print( table_t *t, int (*cmp)(const void *, const void *), int max )
+{
+    entry_t *sorted = malloc( (t->used + 1) * sizeof(entry_t) );
+    size_t i, n = 0;
+
+    for( i = 0; i < t->size; i++ ) {
+        if( t->entries[i].count ) {
+            sorted[ n++ ] = t->entries[i];
+        }
+    }
+
+    qsort( sorted, n, sizeof(entry_t), cmp );
+
+    for( i = 0; i < n && (!max || i < (size_t)max); i++ ) {
+        printf( "  %-40s %12llu\n", sorted[i].key, (unsigned long long)sorted[i].count );
+    }
+
+    free( sorted );
+}
+
+/* ********************************************
+
+    Decoding UIDs
+
+   ******************************************** */
+
+// Decode a UID. 'ts' and 'xff' are the log line's TS & XFF fields, used
+// for formats that don't carry the time or ip themselves; that makes them
+// the time & ip of this sighting, which is only the mint time & ip on the
+// line that minted the UID.
+static void decode_uid( const char *uid, size_t len,
+                        const char *ts, size_t ts_len,
+                        const char *xff, size_t xff_len,
+                        uid_info_t *info )
+{
+    const char *dot = NULL;
+    size_t i, digits;
+
+    memset( info, 0, sizeof(*info) );
+
+    // ip.time: the time is the digits after the last dot
+    for( i = len; i > 0; i-- ) {
+        if( uid[ i - 1 ] == '.' ) {
+            dot = &uid[ i - 1 ];
+            break;
+        }
+    }
+
+    if( dot && dot > uid ) {
+        const char *t = dot + 1;
+        int64_t value = 0;
+
+        digits = len - (t - uid);
+
+        for( i = 0; i < digits && t[i] >= '0' && t[i] <= '9'; i++ ) {
+            value = value * 10 + (t[i] - '0');
+        }
+
+        // only digits after the dot, and an ip-ish thing before it
+        if( i == digits && (memchr( uid, '.', dot - uid ) || memchr( uid, ':', dot - uid )) ) {
+            size_t ip_len = dot - uid;
+
+            if( digits == 16 ) {
+                info->format = FMT_BUILTIN;
+                info->usec   = value;
+            } else if( digits == 13 ) {
+                info->format = FMT_LEGACY;
+                info->usec   = value * 1000;
+            } else if( digits == 10 ) {
+                info->format = FMT_LEGACY;
+                info->usec   = value * 1000000;
+            }
+
+            if( info->format != FMT_UNKNOWN ) {
+                if( ip_len > MAX_KEY ) {
+                    ip_len = MAX_KEY;
+                }
+                memcpy( info->ip, uid, ip_len );
+                info->ip[ ip_len ] = '\0';
+                return;
+            }
+        }
+    }
+
+    // base 62 sequential ids; 11 digits is enough for 64 bits
+    if( len >= 1 && len <= 11 ) {
+        uint64_t seq = 0;
+
+        for( i = 0; i < len; i++ ) {
+            const char *d = memchr( SEQ_DIGITS, uid[i], 62 );
+            if( !d ) {
+                return;
+            }
+            seq = seq * 62 + (d - SEQ_DIGITS);
+        }
+
+        info->format = FMT_SEQUENTIAL;
+        info->seq    = seq;
+
+        for( i = 0; i < ts_len && ts[i] >= '0' && ts[i] <= '9'; i++ ) {
+            info->usec = info->usec * 10 + (ts[i] - '0');
+        }
+        info->usec *= 1000000;
+
+        // the client ip is the right most one in XFF, like mod_cookietrack does
+        if( xff_len && !(xff_len == 1 && xff[0] == '-') ) {
+            const char *ip = xff;
+
+            for( i = xff_len; i > 0; i-- ) {
+                if( xff[ i - 1 ] == ',' ) {
+                    ip = &xff[i];
+                    break;
+                }
+            }
+            while( ip < xff + xff_len && *ip == ' ' ) {
+                ip++;
+            }
+
+            size_t ip_len = xff + xff_len - ip;
+            if( ip_len > MAX_KEY ) {
+                ip_len = MAX_KEY;
+            }
+            memcpy( info->ip, ip, ip_len );
+            info->ip[ ip_len ] = '\0';
+        }
+    }
+}
+
+static void print_time( int64_t usec, char *buf, size_t len, const char *fmt )
+{
+    time_t sec = usec / 1000000;
+    struct tm tm;
+
+    gmtime_r( &sec, &tm );
+    strftime( buf, len, fmt, &tm );
+}
+
+/* ********************************************
+
+    Scanning logs
+
+   ******************************************** */
+
+// Find "name":" in a line, and return the value up to the closing quote.
+// Values are JSON escaped by Apache, so they never contain a bare quote.
+static const char *find_field( const char *line, const char *end,
+                               const char *key, size_t key_len, size_t *len )
+{
+    const char *value = memmem( line, end - line, key, key_len );
+    const char *quote;
+
+    if( !value ) {
+        return NULL;
+    }
+
+    value += key_len;
+    if( !(quote = memchr( value, '"', end - value )) ) {
+        return NULL;
+    }
+
+    *len = quote - value;
+    return value;
+}
+
+// Build the "name":" needle for a field
+static char *field_key( const char *name )
+{
+    size_t len = strlen( name ) + 5;
+    char *key  = malloc( len );
+
+    snprintf( key, len, "\"%s\":\"", name );
+    return key;
+}
+
+static void scan_line( worker_t *w, const char *line, const char *end,
+                       const char *uid_key, const char *gen_key,
+                       const char *ts_key, const char *ip_key )
+{
+    size_t uid_len, gen_len, ts_len = 0, ip_len = 0;
+    const char *uid, *gen, *ts, *ip;
+    uid_info_t info;
+
+    w->lines++;
+
+    if( !(uid = find_field( line, end, uid_key, strlen( uid_key ), &uid_len ))
+        || !uid_len || (uid_len == 1 && uid[0] == '-') ) {
+        return;
+    }
+
+    if( uid_len == strlen( settings.dnt_value )
+        && strncmp( uid, settings.dnt_value, uid_len ) == 0 ) {
+        return;
+    }
+
+    w->uids++;
+
+    // only count UIDs when they're minted, unless asked otherwise
+    if( !settings.all ) {
+        gen = find_field( line, end, gen_key, strlen( gen_key ), &gen_len );
+        if( !gen || gen_len != 1 || gen[0] != '1' ) {
+            return;
+        }
+    }
+
+    ts = find_field( line, end, ts_key, strlen( ts_key ), &ts_len );
+    ip = find_field( line, end, ip_key, strlen( ip_key ), &ip_len );
+
+    decode_uid( uid, uid_len, ts, ts ? ts_len : 0, ip, ip ? ip_len : 0, &info );
+
+    // returning visitors show up on many lines; count them once, later
+    uid_table_add( &w->uids_seen, uid, uid_len, &info );
+}
+
+static void *scan_chunk( void *data )
+{
+    worker_t *w         = data;
+    const char *line    = w->start;
+    char *uid_key       = field_key( settings.uid_field );
+    char *gen_key       = field_key( GEN_FIELD );
+    char *ts_key        = field_key( TS_FIELD );
+    char *ip_key        = field_key( IP_FIELD );
+
+    while( line < w->end ) {
+        const char *eol = memchr( line, '\n', w->end - line );
+
+        if( !eol ) {
+            eol = w->end;
+        }
+
+        scan_line( w, line, eol, uid_key, gen_key, ts_key, ip_key );
+        line = eol + 1;
+    }
+
+    free( uid_key );
+    free( gen_key );
+    free( ts_key );
+    free( ip_key );
+
+    return NULL;
+}
+
+// Scan a file with all threads, each taking a chunk of whole lines
+static int scan_file( const char *path, worker_t *workers )
+{
+    struct stat st;
+    const char *data;
+    int fd, i;
+    pthread_t threads[ MAX_THREADS ];
+
+    if( (fd = open( path, O_RDONLY )) < 0 || fstat( fd, &st ) < 0 ) {
+        fprintf( stderr, "Can't open %s: %s\n", path, strerror( errno ) );
+        return 0;
+    }
+
+    if( !st.st_size ) {
+        close( fd );
+        return 1;
+    }
+
+    data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+
+    if( data == MAP_FAILED ) {
+        fprintf( stderr, "Can't mmap %s: %s\n", path, strerror( errno ) );
+        return 0;
+    }
+
+    madvise( (void *)data, st.st_size, MADV_SEQUENTIAL );
+
+    const char *start = data;
+    const char *end   = data + st.st_size;
+    int started       = 0;
+    int rv;
+
+    for( i = 0; i < settings.threads; i++ ) {
+        const char *stop = data + st.st_size / settings.threads * (i + 1);
+
+        // end the chunk after a newline, so no line is split
+        if( i == settings.threads - 1 || stop >= end ) {
+            stop = end;
+        } else if( stop < start ) {
+            stop = start;
+        } else {
+            const char *eol = memchr( stop, '\n', end - stop );
+            stop = eol ? eol + 1 : end;
+        }
+
+        workers[i].start = start;
+        workers[i].end   = stop;
+        start            = stop;
+
+        // pthread functions return the error, rather than set errno
+        if( (rv = pthread_create( &threads[i], NULL, scan_chunk, &workers[i] )) != 0 ) {
+            fprintf( stderr, "Can't start thread %d for %s: %s\n", i, path, strerror( rv ) );
+            break;
+        }
+        started++;
+    }
+
+    // wait for the ones we did start, even if we can't use their results
+    for( i = 0; i < started; i++ ) {
+        pthread_join( threads[i], NULL );
+    }
+
+    munmap( (void *)data, st.st_size );
+
+    return started == settings.threads;
+}
+
+/* ********************************************
+
+    Main
+
+   ******************************************** */
+
+static void usage( const char *me )
+{
+    fprintf( stderr,
+        "\n"
+        "  %s [-t threads] [-f field] [-d dnt-value] [-H] [-a] [-n top-ips] log...\n"
+        "  %s -u uid...\n"
+        "\n"
+        "    -t  number of threads; defaults to the number of cpus\n"
+        "    -f  log field holding the UID; defaults to " UID_FIELD "\n"
+        "    -d  CookieDNTValue; these are skipped. Defaults to " DNT_VALUE "\n"
+        "    -H  show first seen per hour, rather than per day\n"
+        "    -a  count every UID in the logs, not just those minted in them\n"
+        "    -n  number of ips to show; 0 for all. Defaults to %d\n"
+        "    -u  decode the given UIDs, rather than scanning logs\n"
+        "\n", me, me, TOP_IPS );
+}
+
+// Decode UIDs given on the command line
+static void print_uids( char **uids, int n )
+{
+    int i;
+
+    for( i = 0; i < n; i++ ) {
+        uid_info_t info;
+        char when[ 64 ] = "-";
+
+        decode_uid( uids[i], strlen( uids[i] ), NULL, 0, NULL, 0, &info );
+
+        if( info.usec ) {
+            print_time( info.usec, when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ" );
+        }
+
+        if( info.format == FMT_SEQUENTIAL ) {
+            printf( "%s\t%s\tid=%llu\n", uids[i], format_names[ info.format ],
+                    (unsigned long long)info.seq );
+        } else {
+            printf( "%s\t%s\tfirst_seen=%s\tip=%s\n", uids[i], format_names[ info.format ],
+                    when, info.ip[0] ? info.ip : "-" );
+        }
+    }
+}
+
+int main( int argc, char **argv )
+{
+    worker_t *workers;
+    uid_table_t uids_seen;
+    table_t first_seen, ips;
+    uint64_t lines = 0, uids = 0, formats[ FMT_COUNT ] = { 0 };
+    int64_t cached_bucket = -1;
+    char cached_label[ MAX_KEY + 1 ];
+    int decode = 0;
+    int opt, i, f;
+    size_t u;
+
+    settings.uid_field = UID_FIELD;
+    settings.dnt_value = DNT_VALUE;
+    settings.top       = TOP_IPS;
+    settings.threads   = sysconf( _SC_NPROCESSORS_ONLN );
+
+    while( (opt = getopt( argc, argv, "t:f:d:Han:uh" )) != -1 ) {
+        switch( opt ) {
+        case 't': settings.threads   = atoi( optarg ); break;
+        case 'f': settings.uid_field = optarg;         break;
+        case 'd': settings.dnt_value = optarg;         break;
+        case 'H': settings.hourly    = 1;              break;
+        case 'a': settings.all       = 1;              break;
+        case 'n': settings.top       = atoi( optarg ); break;
+        case 'u': decode             = 1;              break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if( optind >= argc ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if( decode ) {
+        print_uids( &argv[ optind ], argc - optind );
+        return 0;
+    }
+
+    if( settings.threads < 1 ) {
+        settings.threads = 1;
+    } else if( settings.threads > MAX_THREADS ) {
+        settings.threads = MAX_THREADS;
+    }
+
+    workers = calloc( settings.threads, sizeof(worker_t) );
+
+    for( i = 0; i < settings.threads; i++ ) {
+        uid_table_init( &workers[i].uids_seen, 1024 );
+    }
+
+    for( f = optind; f < argc; f++ ) {
+        if( !scan_file( argv[f], workers ) ) {
+            return 1;
+        }
+    }
+
+    // merge what the threads found
+    uid_table_init( &uids_seen, 1024 );
+
+    for( i = 0; i < settings.threads; i++ ) {
+        lines += workers[i].lines;
+        uids  += workers[i].uids;
+
+        uid_table_merge( &uids_seen, &workers[i].uids_seen );
+        free( workers[i].uids_seen.entries );
+    }
+
+    // and count every distinct UID once
+    table_init( &first_seen, 1024 );
+    table_init( &ips, 1024 );
+
+    for( u = 0; u < uids_seen.size; u++ ) {
+        uid_info_t *info = &uids_seen.entries[u].info;
+
+        if( !uids_seen.entries[u].key[0] ) {
+            continue;
+        }
+
+        formats[ info->format ]++;
+
+        if( info->usec ) {
+            int64_t bucket = info->usec / 1000000 / (settings.hourly ? 3600 : 86400);
+
+            // skip gmtime when it's the same bucket as the last UID
+            if( bucket != cached_bucket ) {
+                print_time( info->usec, cached_label, sizeof(cached_label),
+                            settings.hourly ? "%Y-%m-%dT%H" : "%Y-%m-%d" );
+                cached_bucket = bucket;
+            }
+
+            table_add( &first_seen, cached_label, strlen( cached_label ), 1 );
+        }
+
+        if( info->ip[0] ) {
+            table_add( &ips, info->ip, strlen( info->ip ), 1 );
+        }
+    }
+
+    printf( "lines: %llu\n", (unsigned long long)lines );
+    printf( "lines with a uid: %llu\n", (unsigned long long)uids );
+    printf( "%s uids by format:\n", settings.all ? "all" : "minted" );
+    for( f = 0; f < FMT_COUNT; f++ ) {
+        printf( "  %-40s %12llu\n", format_names[f], (unsigned long long)formats[f] );
+    }
+
+    printf( "first seen per %s:\n", settings.hourly ? "hour" : "day" );
+    table_print( &first_seen, by_key, 0 );
+
+    printf( "first seen by ip:\n" );
+    table_print( &ips, by_count, settings.top );
+
+    return 0;
+}
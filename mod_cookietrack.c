@@ -17,6 +17,12 @@
 #include "apr.h"
 #include "apr_lib.h"
 #include "apr_strings.h"
+#include "apr_atomic.h"
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+#include "apr_shm.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -33,8 +39,15 @@
 #include "util_script.h"
 #include "http_connection.h"
 
+#include "mod_cookietrack.h"
+
 #include <math.h>
 
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 
 module AP_MODULE_DECLARE_DATA cookietrack_module;
 
@@ -57,16 +70,50 @@ module AP_MODULE_DECLARE_DATA cookietrack_module;
                                 // http://www.onlineconversion.com/unix_time.htm
                                 // using 2038 as it's pre-32 bit overflow.
 
-// XXX This doesn't work because SetEnv/SetEnvIf code isn't run until APR_HOOK_MIDDLE,
-// at which point this code has already run :(
-//#define DNT_IGNORE_ENV_VAR "request_is_dnt_exempt"
-                                // If this env var is set, we consider the request to
-                                // be DNT exempt, regardless of any other settings.
 #define NUM_SUBS 3              // Amount of regex sub expressions
 
 #define GENERATED_NOTE_NAME "cookie_generated"
                                 // Was the cookie generated on this visit?
 
+#define VISIT_SLOTS 65536       // default number of UIDs kept in the visit store
+#define VISIT_WAYS  8           // slots per bucket; the least recently seen one is evicted
+#define VISIT_MAGIC 0x43545632  // "CTV2" - marks an initialized visit store file
+#define VISIT_LOCK_TRIES 128    // spins before we give up on a bucket for this request
+#define VISIT_LOCK_STALE 2      // seconds after which a bucket lock is considered abandoned
+
+#define HITTER_DEPTH 4          // rows in the count-min sketch
+#define HITTER_TOPK 16          // default number of heavy hitters to keep track of
+#define HITTER_WINDOW 60        // default seconds counts are kept for before starting over
+#define HITTER_KEY_LENGTH 64    // longest UID or client ip kept in the top K list
+#define HITTER_HANDLER "cookietrack-status"
+                                // handler showing the current heavy hitters
+
+#define EVENT_RING_SIZE 4096    // default number of events buffered per child
+#define EVENT_BATCH 64          // events written out in one go
+#define EVENT_DRAIN_INTERVAL 100000
+                                // microseconds the drain thread sleeps when idle
+#define EVENT_MAGIC 0x43544531  // "CTE1" - starts every event record
+#define EVENT_IP_LENGTH 46      // longest client ip in an event; INET6_ADDRSTRLEN
+#define EVENT_SOCKET_PREFIX "unix:"
+                                // CookieEventLog prefix for a datagram socket target
+
+#define SEQUENCE_BLOCK 4096     // sequential UIDs a child leases at a time
+#define SEQUENCE_RESERVE 1024   // blocks leased between syncs of the high water mark
+#define SEQUENCE_MAGIC 0x43545331
+                                // "CTS1" - marks an initialized sequence file
+#define SEQUENCE_SYNC_WAITS 100 // 100us naps waiting for another child's msync(), before
+                                // we sync the high water mark ourselves
+#define SEQUENCE_BOOT_ID "/proc/sys/kernel/random/boot_id"
+                                // changes on every boot; Linux only
+#define SEQUENCE_BOOT_ID_LENGTH 40
+                                // a boot id is a 36 character uuid
+#define SEQUENCE_DIGITS "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                                // sequential UIDs are rendered in base 62
+
+#define SAMPLE_SCALE 10000      // Resolution of CookieSampleRate; 1 == 0.01% of visitors
+#define SAMPLE_HASH_SEED 2166136261U
+                                // FNV-1a offset basis, used to start every sample hash
+
 #ifdef MAX_COOKIE_LENGTH        // maximum size of the cookie value
 #define _MAX_COOKIE_LENGTH MAX_COOKIE_LENGTH
 #else
@@ -93,6 +140,19 @@ module AP_MODULE_DECLARE_DATA cookietrack_module;
 #define _EXTERNAL_UID_FUNCTION 0
 #endif
 
+// ap_expr variables & functions are only available from Apache 2.4 on
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 0)
+#include "ap_expr.h"
+#define _HAVE_AP_EXPR 1
+#else
+#define _HAVE_AP_EXPR 0
+#endif
+
+#define EXPR_VAR_PREFIX "COOKIETRACK_"
+                                // ap_expr variables are named COOKIETRACK_<FIELD>
+#define EXPR_FUNC_NAME  "cookietrack"
+                                // ap_expr function, used as cookietrack('<field>')
+
 // the type of cookie to set
 typedef enum {
     CT_UNSET,       // falls back to netscape
@@ -101,6 +161,28 @@ typedef enum {
     CT_COOKIE2      // rfc 2965, using max-age
 } cookie_type_e;
 
+// how to generate new UIDs
+typedef enum {
+    CT_GEN_DEFAULT,     // ip.microtime, or the external library
+    CT_GEN_SEQUENTIAL   // dense 64 bit ids, leased from shared memory
+} uid_generator_e;
+
+// what to do when a CookieTrackingIf condition matches
+typedef enum {
+    CT_IF_ON,           // track this request
+    CT_IF_OFF,          // don't track this request
+    CT_IF_DNT_EXEMPT    // track this request, ignoring DNT
+} tracking_if_e;
+
+// a CookieTrackingIf condition, parsed at config time
+typedef struct {
+    tracking_if_e action;
+    const char *expr_string;    // save for debugging
+#if _HAVE_AP_EXPR
+    ap_expr_info_t *expr;
+#endif
+} tracking_if_rec;
+
 // module configuration - this is basically a global struct
 typedef struct {
     int enabled;            // module enabled?
@@ -125,9 +207,1081 @@ typedef struct {
                             // cookie values that are DNT exempt, e.g OPTOUT
     apr_array_header_t *dnt_exempt_browser;
                             // browser values that are DNT exempt, e.g 'MSIE 10.0'
+    int sample_rate;        // visitors to track, out of SAMPLE_SCALE
+    uid_generator_e generator;
+                            // how to generate new UIDs
+    apr_array_header_t *tracking_if;
+                            // CookieTrackingIf conditions, in config order
+    int track_visits;       // record visits in the visit store?
+    int uid_hitter_threshold;
+                            // requests per UID per window to flag a heavy hitter at
+    int ip_hitter_threshold;
+                            // requests per client ip per window to flag a heavy hitter at
 
 } cookietrack_settings_rec;
 
+// a UID in the visit store. Fixed size, so the store never allocates.
+typedef struct {
+    char uid[ _MAX_COOKIE_LENGTH + 1 ];
+    apr_uint32_t hits;      // requests seen for this UID
+    apr_time_t first_seen;
+    apr_time_t last_seen;
+} visit_slot_t;
+
+// a set of slots a UID can live in; guarded by a spin lock holding the
+// time (in seconds) it was taken, so a crashed child can't hold it forever
+typedef struct {
+    volatile apr_uint32_t lock;
+    visit_slot_t slots[ VISIT_WAYS ];
+} visit_bucket_t;
+
+// the visit store, as laid out in the mmap'd file
+typedef struct {
+    apr_uint32_t magic;
+    apr_uint32_t slot_size; // sizeof(visit_slot_t), to detect incompatible builds
+    apr_uint32_t nbuckets;
+    visit_bucket_t buckets[];
+} visit_store_t;
+
+// an entry in a heavy hitter top K list
+typedef struct {
+    apr_uint32_t count;
+    char key[ HITTER_KEY_LENGTH + 1 ];
+} hitter_t;
+
+// a count-min sketch plus top K list, in shared memory. Counters are only
+// ever updated atomically; the top K list is guarded by a lock that is
+// tried once and never waited for.
+typedef struct {
+    volatile apr_uint32_t window;   // time window these counts are for
+    volatile apr_uint32_t lock;     // guards the top K list
+    volatile apr_uint32_t top_window;
+                                    // time window the top K list is for
+    volatile apr_uint32_t top_min;  // smallest count in a full top K list
+    volatile apr_uint32_t counters[];
+                                    // HITTER_DEPTH rows of hitter_width counters,
+                                    // followed by hitter_topk hitter_t's
+} hitter_sketch_t;
+
+// the sequence counter, as laid out in the mmap'd file. 'next' may run
+// ahead of what's on disk, but ids are only handed out below 'high_water',
+// which is synced to disk before it's used.
+typedef struct {
+    apr_uint32_t magic;
+    apr_uint32_t reserved;
+    volatile apr_uint64_t next;         // first id of the next block to lease
+    volatile apr_uint64_t high_water;   // no id at or above this was handed out
+    volatile apr_uint64_t synced;       // high_water as known to be on disk; only
+                                        // raised once msync() has returned
+    char boot_id[ SEQUENCE_BOOT_ID_LENGTH ];
+                                        // boot the counter was last opened in
+} sequence_store_t;
+
+// a block of ids leased by a child; 'used' may run past SEQUENCE_BLOCK
+// as request threads race for the last ids
+typedef struct {
+    apr_uint64_t base;
+    volatile apr_uint32_t used;
+} sequence_block_t;
+
+// an event record, as written to the CookieEventLog. Fixed size, in host
+// byte order; 'length' is the record size, as it depends on the build.
+typedef struct {
+    apr_uint32_t magic;
+    apr_uint32_t ua_hash;   // FNV-1a hash of the User-Agent
+    apr_time_t timestamp;   // microseconds since the epoch
+    apr_uint16_t length;
+    apr_uint8_t dnt;        // was the DNT header set?
+    apr_uint8_t reserved;
+    char uid[ _MAX_COOKIE_LENGTH + 1 ];
+    char ip[ EVENT_IP_LENGTH + 1 ];
+} event_record_t;
+
+// a slot in the event ring; 'seq' tells producers and the drain thread
+// whose turn it is (see Vyukov's bounded MPMC queue)
+typedef struct {
+    volatile apr_uint32_t seq;
+    event_record_t record;
+} event_cell_t;
+
+// the per child event ring. Request threads claim slots with a CAS on
+// 'head' and never wait; if the ring is full, the event is dropped.
+typedef struct {
+    apr_uint32_t mask;      // ring size - 1; the size is a power of 2
+    volatile apr_uint32_t head;
+                            // next slot to write; claimed by request threads
+    apr_uint32_t tail;      // next slot to read; drain thread only
+    volatile apr_uint32_t dropped;
+                            // events dropped because the ring was full
+    volatile apr_uint32_t stop;
+                            // set when the child exits
+    int sock;               // datagram socket, if writing to a socket
+    server_rec *server;
+    apr_thread_t *thread;
+    event_cell_t *cells;
+} event_ring_t;
+
+// server wide settings & state, set through global only directives. There
+// is only one of these, as the shared memory is shared by all vhosts.
+typedef struct {
+    const char *visit_file; // file backing the visit store
+    int visit_slots;        // number of UIDs to keep in the visit store
+    visit_store_t *visits;  // the visit store, mapped in post_config
+    int hitter_width;       // counters per row of the heavy hitter sketches
+    int hitter_topk;        // heavy hitters to keep track of
+    int hitter_window;      // seconds before heavy hitter counts start over
+    hitter_sketch_t *uid_hitters;
+                            // requests per UID, set up in post_config
+    hitter_sketch_t *ip_hitters;
+                            // requests per client ip, set up in post_config
+    const char *event_target;
+                            // file or unix:socket to write events to
+    int event_ring_size;    // events buffered per child
+    apr_file_t *event_file; // the event file, opened in post_config
+    event_ring_t *events;   // this child's event ring, set up in child_init
+    const char *sequence_file;
+                            // file backing the sequential UID counter
+    sequence_store_t *sequence;
+                            // the sequence counter, mapped in post_config
+    sequence_block_t blocks[2];
+                            // this child's current & previous id block
+    sequence_block_t * volatile block;
+                            // the block ids are currently taken from
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lease_mutex;
+                            // only taken to lease a new block, set up in child_init
+#endif
+} cookietrack_global_rec;
+
+static cookietrack_global_rec cookietrack_global;
+
+// used to hash UIDs for both sampling and the shared memory stores
+static apr_uint32_t sample_hash( apr_uint32_t hash, const char *str, apr_size_t len );
+static apr_uint32_t hash_mix( apr_uint32_t hash );
+
+// what we resolved for this request - exposed to other modules through
+// the optional functions in mod_cookietrack.h and through ap_expr
+typedef struct {
+    const char *uid;        // cookie value we set
+    int generated;          // generated on this request?
+    int dnt;                // was DNT honored?
+    const char *client_ip;  // remote ip, possibly from cookie_ip_header
+} cookietrack_request_rec;
+
+
+/* ********************************************
+
+    Shared memory visit store
+
+   ******************************************** */
+
+// Create an empty visit store of the given size next to the old one, and
+// rename it into place. After a graceful restart, children of the previous
+// generation still have the old file mapped, so it's never resized or reset
+// in place: they keep writing to the old file until they exit.
+static apr_status_t create_visit_store( apr_pool_t *p, server_rec *s,
+                                        apr_size_t size, apr_file_t **fh )
+{
+    char *tmp = apr_pstrcat( p, cookietrack_global.visit_file, ".XXXXXX", NULL );
+    apr_status_t rv;
+
+    // explicit flags, as the defaults delete the file on close
+    if( (rv = apr_file_mktemp( fh, tmp,
+                               APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                               | APR_FOPEN_EXCL | APR_FOPEN_BINARY, p )) != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "Can't create CookieVisitStore %s", tmp );
+        return rv;
+    }
+
+    // a sparse file of zeroes; the header is written once it's mapped
+    if( (rv = apr_file_trunc( *fh, size )) != APR_SUCCESS
+        || (rv = apr_file_rename( tmp, cookietrack_global.visit_file, p )) != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "Can't create CookieVisitStore %s", cookietrack_global.visit_file );
+        apr_file_close( *fh );
+        apr_file_remove( tmp, p );
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+// Map the visit store file, replacing it with a new one if it's not in the
+// format and size we want. As it's a shared file mapping, the children
+// inherit it, and whatever they write survives restarts.
+static apr_status_t open_visit_store( apr_pool_t *p, server_rec *s )
+{
+    apr_uint32_t nbuckets = (cookietrack_global.visit_slots + VISIT_WAYS - 1) / VISIT_WAYS;
+    apr_size_t size       = sizeof(visit_store_t) + nbuckets * sizeof(visit_bucket_t);
+    apr_file_t *fh;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_status_t rv;
+    int created           = 0;
+
+    rv = apr_file_open( &fh, cookietrack_global.visit_file,
+                        APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_BINARY,
+                        APR_OS_DEFAULT, p );
+
+    if( rv == APR_SUCCESS ) {
+        visit_store_t header;
+        apr_size_t len = sizeof(header);
+
+        // different size or header means a different CookieVisitStore
+        // setting or module version; start over in a new file
+        if( apr_file_info_get( &finfo, APR_FINFO_SIZE, fh ) != APR_SUCCESS
+            || finfo.size != (apr_off_t)size
+            || apr_file_read_full( fh, &header, len, &len ) != APR_SUCCESS
+            || header.magic != VISIT_MAGIC
+            || header.slot_size != sizeof(visit_slot_t)
+            || header.nbuckets != nbuckets ) {
+
+            apr_file_close( fh );
+            rv = APR_EGENERAL;
+        }
+    }
+
+    if( rv != APR_SUCCESS ) {
+        if( (rv = create_visit_store( p, s, size, &fh )) != APR_SUCCESS ) {
+            return rv;
+        }
+        created = 1;
+    }
+
+    rv = apr_mmap_create( &mm, fh, 0, size, APR_MMAP_READ | APR_MMAP_WRITE, p );
+
+    // the mapping stays valid after the file is closed
+    apr_file_close( fh );
+
+    if( rv != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "Can't mmap CookieVisitStore %s", cookietrack_global.visit_file );
+        return rv;
+    }
+
+    visit_store_t *store = mm->mm;
+
+    // nobody else has this mapped yet, so no need to be careful
+    if( created ) {
+        store->slot_size = sizeof(visit_slot_t);
+        store->nbuckets  = nbuckets;
+        store->magic     = VISIT_MAGIC;
+    }
+
+    _DEBUG && fprintf( stderr, "Visit store %s: %u buckets, %" APR_SIZE_T_FMT " bytes%s\n",
+                       cookietrack_global.visit_file, nbuckets, size,
+                       created ? ", created" : "" );
+
+    cookietrack_global.visits = store;
+
+    return APR_SUCCESS;
+}
+
+// Take the bucket lock, stealing it if its holder seems to have died.
+// Returns 0 if we couldn't get it; we'd rather skip than block a request.
+// The lock holds the wall clock time it was taken; not the request time,
+// as a request that started earlier than the holder's would otherwise see
+// a held lock as stale.
+static int lock_visit_bucket( visit_bucket_t *bucket )
+{
+    apr_uint32_t sec = (apr_uint32_t)apr_time_sec( apr_time_now() );
+    int i;
+
+    // 0 means unlocked, so never use it as a lock value
+    if( !sec ) {
+        sec = 1;
+    }
+
+    for( i = 0; i < VISIT_LOCK_TRIES; i++ ) {
+        apr_uint32_t held = apr_atomic_read32( &bucket->lock );
+
+        if( (!held || (apr_int32_t)(sec - held) > VISIT_LOCK_STALE)
+            && apr_atomic_cas32( &bucket->lock, sec, held ) == held ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void unlock_visit_bucket( visit_bucket_t *bucket )
+{
+    apr_atomic_xchg32( &bucket->lock, 0 );
+}
+
+// Record a visit for uid, and copy what we know about it into visit
+static int record_visit( const char *uid, apr_time_t now, visit_slot_t *visit )
+{
+    visit_store_t *store   = cookietrack_global.visits;
+    apr_uint32_t hash      = hash_mix( sample_hash( SAMPLE_HASH_SEED, uid, _MAX_COOKIE_LENGTH ) );
+    visit_bucket_t *bucket = &store->buckets[ hash % store->nbuckets ];
+    visit_slot_t *slot     = NULL;
+    int i;
+
+    if( !lock_visit_bucket( bucket ) ) {
+        return 0;
+    }
+
+    for( i = 0; i < VISIT_WAYS; i++ ) {
+        visit_slot_t *cur = &bucket->slots[i];
+
+        if( strncmp( cur->uid, uid, _MAX_COOKIE_LENGTH ) == 0 ) {
+            slot = cur;
+            break;
+        }
+
+        // pick an empty slot, or otherwise the least recently seen one
+        if( !slot || (slot->uid[0] && (!cur->uid[0] || cur->last_seen < slot->last_seen)) ) {
+            slot = cur;
+        }
+    }
+
+    // new UID; this evicts whatever was there
+    if( i == VISIT_WAYS ) {
+        apr_cpystrn( slot->uid, uid, sizeof(slot->uid) );
+        slot->hits       = 0;
+        slot->first_seen = now;
+        slot->last_seen  = now;
+    }
+
+    // hand back the previous visit, but count this one
+    slot->hits++;
+    *visit = *slot;
+    slot->last_seen = now;
+
+    unlock_visit_bucket( bucket );
+
+    return 1;
+}
+
+// Publish what the visit store knows about this UID as notes & headers
+static void publish_visit( request_rec *r, cookietrack_settings_rec *dcfg, const char *uid )
+{
+    visit_slot_t visit;
+
+    if( !record_visit( uid, r->request_time, &visit ) ) {
+        _DEBUG && fprintf( stderr, "Visit store busy, skipping %s\n", uid );
+        return;
+    }
+
+    const char *first_seen = apr_psprintf( r->pool, "%" APR_TIME_T_FMT,
+                                           apr_time_sec( visit.first_seen ) );
+    const char *last_seen  = apr_psprintf( r->pool, "%" APR_TIME_T_FMT,
+                                           apr_time_sec( visit.last_seen ) );
+    const char *visits     = apr_psprintf( r->pool, "%u", visit.hits );
+
+    _DEBUG && fprintf( stderr, "Visit %s: first %s, last %s, visits %s\n",
+                       uid, first_seen, last_seen, visits );
+
+    apr_table_setn( r->notes, apr_pstrcat( r->pool, dcfg->note_name, "_first_seen", NULL ),
+                    first_seen );
+    apr_table_setn( r->notes, apr_pstrcat( r->pool, dcfg->note_name, "_last_seen", NULL ),
+                    last_seen );
+    apr_table_setn( r->notes, apr_pstrcat( r->pool, dcfg->note_name, "_visits", NULL ),
+                    visits );
+
+    // Set headers? We set both incoming AND outgoing, like the UID header:
+    if( dcfg->send_header ) {
+        const char *first_header = apr_pstrcat( r->pool, dcfg->header_name, "-First-Seen", NULL );
+        const char *last_header  = apr_pstrcat( r->pool, dcfg->header_name, "-Last-Seen", NULL );
+        const char *visit_header = apr_pstrcat( r->pool, dcfg->header_name, "-Visits", NULL );
+
+        apr_table_setn( r->headers_in,      first_header, first_seen );
+        apr_table_setn( r->headers_in,      last_header,  last_seen );
+        apr_table_setn( r->headers_in,      visit_header, visits );
+        apr_table_setn( r->err_headers_out, first_header, first_seen );
+        apr_table_setn( r->err_headers_out, last_header,  last_seen );
+        apr_table_setn( r->err_headers_out, visit_header, visits );
+    }
+}
+
+/* ********************************************
+
+    Shared memory heavy hitter detection
+
+   ******************************************** */
+
+static apr_size_t hitter_sketch_size( void )
+{
+    return sizeof(hitter_sketch_t)
+           + HITTER_DEPTH * cookietrack_global.hitter_width * sizeof(apr_uint32_t)
+           + cookietrack_global.hitter_topk * sizeof(hitter_t);
+}
+
+static hitter_t *hitter_top( hitter_sketch_t *sketch )
+{
+    return (hitter_t *)&sketch->counters[ HITTER_DEPTH * cookietrack_global.hitter_width ];
+}
+
+// Set up the UID & client ip sketches in one anonymous shared memory
+// segment; the children inherit it. Counts don't need to survive restarts.
+static apr_status_t open_hitter_sketches( apr_pool_t *p, server_rec *s )
+{
+    apr_size_t size = APR_ALIGN_DEFAULT( hitter_sketch_size() );
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    if( (rv = apr_shm_create( &shm, 2 * size, NULL, p )) != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "Can't create shared memory for CookieHeavyHitterSketch" );
+        return rv;
+    }
+
+    char *base = apr_shm_baseaddr_get( shm );
+    memset( base, 0, 2 * size );
+
+    cookietrack_global.uid_hitters = (hitter_sketch_t *)base;
+    cookietrack_global.ip_hitters  = (hitter_sketch_t *)(base + size);
+
+    return APR_SUCCESS;
+}
+
+// Keep key in the top K list if it's counted often enough
+static void update_hitter_top( hitter_sketch_t *sketch, const char *key,
+                               apr_uint32_t count, apr_uint32_t window )
+{
+    hitter_t *top = hitter_top( sketch );
+    hitter_t *min = NULL;
+    int i;
+
+    // someone else is updating the list; this key will come round again
+    if( apr_atomic_cas32( &sketch->lock, 1, 0 ) != 0 ) {
+        return;
+    }
+
+    // the list is from another window. If it's a later one, this request
+    // started before the rollover and no longer counts; otherwise start over
+    if( apr_atomic_read32( &sketch->top_window ) != window ) {
+        if( window < apr_atomic_read32( &sketch->top_window ) ) {
+            apr_atomic_xchg32( &sketch->lock, 0 );
+            return;
+        }
+
+        memset( top, 0, cookietrack_global.hitter_topk * sizeof(hitter_t) );
+        apr_atomic_set32( &sketch->top_min, 0 );
+        apr_atomic_set32( &sketch->top_window, window );
+    }
+
+    for( i = 0; i < cookietrack_global.hitter_topk; i++ ) {
+        if( strncmp( top[i].key, key, HITTER_KEY_LENGTH ) == 0 ) {
+            min = &top[i];
+            break;
+        }
+
+        if( !min || top[i].count < min->count ) {
+            min = &top[i];
+        }
+    }
+
+    if( min && count > min->count ) {
+        if( i == cookietrack_global.hitter_topk ) {
+            apr_cpystrn( min->key, key, sizeof(min->key) );
+        }
+        min->count = count;
+
+        // remember the bar to clear, so most requests can skip the lock
+        apr_uint32_t bar = top[0].count;
+        for( i = 1; i < cookietrack_global.hitter_topk; i++ ) {
+            if( top[i].count < bar ) {
+                bar = top[i].count;
+            }
+        }
+        apr_atomic_set32( &sketch->top_min, bar );
+    }
+
+    apr_atomic_xchg32( &sketch->lock, 0 );
+}
+
+// Count a request for key, and return how many we've seen in this window.
+// Count-min estimates are never too low, and only too high on collisions.
+static apr_uint32_t count_hitter( hitter_sketch_t *sketch, const char *key, apr_uint32_t window )
+{
+    apr_uint32_t width = cookietrack_global.hitter_width;
+    apr_uint32_t cur   = apr_atomic_read32( &sketch->window );
+    apr_uint32_t h1, h2, count = 0;
+    int i;
+
+    // A new window; whoever swaps the window number clears the counts. A
+    // few increments racing with this get lost, which only undercounts.
+    // The top K list is cleared under its lock, in update_hitter_top().
+    if( cur != window && apr_atomic_cas32( &sketch->window, window, cur ) == cur ) {
+        memset( (void *)sketch->counters, 0, HITTER_DEPTH * width * sizeof(apr_uint32_t) );
+    }
+
+    // one hash per row, derived from two (Kirsch & Mitzenmacher)
+    h1 = hash_mix( sample_hash( SAMPLE_HASH_SEED, key, HITTER_KEY_LENGTH ) );
+    h2 = ((h1 >> 16) | (h1 << 16)) * 0x85ebca6b | 1;
+
+    for( i = 0; i < HITTER_DEPTH; i++ ) {
+        apr_uint32_t idx = (h1 + i * h2) % width;
+        apr_uint32_t c   = apr_atomic_inc32( &sketch->counters[ i * width + idx ] ) + 1;
+
+        if( !count || c < count ) {
+            count = c;
+        }
+    }
+
+    if( count > apr_atomic_read32( &sketch->top_min )
+        || apr_atomic_read32( &sketch->top_window ) != window ) {
+        update_hitter_top( sketch, key, count, window );
+    }
+
+    return count;
+}
+
+// Flag this request as coming from a heavy hitter, so e.g. mod_rewrite or
+// the backend can act on it. Flags for UID and client ip add up.
+static void flag_hitter( request_rec *r, cookietrack_settings_rec *dcfg, const char *flag )
+{
+    const char *name = apr_pstrcat( r->pool, dcfg->note_name, "_heavy_hitter", NULL );
+    const char *cur  = apr_table_get( r->notes, name );
+
+    if( cur ) {
+        flag = apr_pstrcat( r->pool, flag, " ", cur, NULL );
+    }
+
+    _DEBUG && fprintf( stderr, "Heavy hitter: %s\n", flag );
+
+    apr_table_setn( r->notes,          name, flag );
+    apr_table_setn( r->subprocess_env, name, flag );
+}
+
+static apr_uint32_t hitter_window( request_rec *r )
+{
+    return (apr_uint32_t)( apr_time_sec( r->request_time ) / cookietrack_global.hitter_window );
+}
+
+// Count this request per client ip. This is done for every request we're
+// enabled for, even those we end up not setting a cookie for.
+static void detect_ip_hitter( request_rec *r, cookietrack_settings_rec *dcfg,
+                              const char *client_ip )
+{
+    if( !client_ip ) {
+        return;
+    }
+
+    apr_uint32_t count = count_hitter( cookietrack_global.ip_hitters, client_ip,
+                                       hitter_window( r ) );
+
+    if( count >= (apr_uint32_t)dcfg->ip_hitter_threshold ) {
+        flag_hitter( r, dcfg, "ip" );
+    }
+}
+
+// Count this request per UID, once we know which one it is
+static void detect_uid_hitter( request_rec *r, cookietrack_settings_rec *dcfg,
+                               cookietrack_request_rec *rrec )
+{
+    // all DNT requests share one cookie value, so don't count those by UID
+    if( rrec->dnt ) {
+        return;
+    }
+
+    apr_uint32_t count = count_hitter( cookietrack_global.uid_hitters, rrec->uid,
+                                       hitter_window( r ) );
+
+    if( count >= (apr_uint32_t)dcfg->uid_hitter_threshold ) {
+        flag_hitter( r, dcfg, "uid" );
+    }
+}
+
+static int compare_hitters( const void *a, const void *b )
+{
+    apr_uint32_t ca = ((const hitter_t *)a)->count;
+    apr_uint32_t cb = ((const hitter_t *)b)->count;
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static void print_hitters( request_rec *r, const char *name, hitter_sketch_t *sketch )
+{
+    apr_uint32_t window = hitter_window( r );
+    hitter_t *top = apr_pmemdup( r->pool, hitter_top( sketch ),
+                                 cookietrack_global.hitter_topk * sizeof(hitter_t) );
+    int i;
+
+    ap_rprintf( r, "%s:\n", name );
+
+    // nothing counted in this window yet
+    if( apr_atomic_read32( &sketch->top_window ) != window ) {
+        return;
+    }
+
+    qsort( top, cookietrack_global.hitter_topk, sizeof(hitter_t), compare_hitters );
+
+    for( i = 0; i < cookietrack_global.hitter_topk && top[i].count; i++ ) {
+        // the copy is unlocked, so make sure the key is terminated
+        top[i].key[ HITTER_KEY_LENGTH ] = '\0';
+        ap_rprintf( r, "  %10u %s\n", top[i].count, top[i].key );
+    }
+}
+
+// Show the current top K per UID & client ip, for SetHandler cookietrack-status
+static int hitter_status_handler( request_rec *r )
+{
+    if( !r->handler || strcmp( r->handler, HITTER_HANDLER ) != 0 ) {
+        return DECLINED;
+    }
+
+    if( r->method_number != M_GET ) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    if( !cookietrack_global.uid_hitters ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r,
+                       "%s handler needs CookieHeavyHitterSketch to be set", HITTER_HANDLER );
+        return HTTP_NOT_FOUND;
+    }
+
+    ap_set_content_type( r, "text/plain" );
+
+    if( r->header_only ) {
+        return OK;
+    }
+
+    ap_rprintf( r, "window: %d seconds\n", cookietrack_global.hitter_window );
+    print_hitters( r, "uid", cookietrack_global.uid_hitters );
+    print_hitters( r, "ip",  cookietrack_global.ip_hitters );
+
+    return OK;
+}
+
+/* ********************************************
+
+    Asynchronous event stream of generated UIDs
+
+   ******************************************** */
+
+#if APR_HAS_THREADS
+
+// Queue an event; called from request threads, so this never blocks
+static void push_event( event_ring_t *ring, const event_record_t *record )
+{
+    apr_uint32_t pos = apr_atomic_read32( &ring->head );
+    event_cell_t *cell;
+
+    for( ;; ) {
+        cell = &ring->cells[ pos & ring->mask ];
+        apr_int32_t diff = (apr_int32_t)( apr_atomic_read32( &cell->seq ) - pos );
+
+        // this slot is free; try to claim it
+        if( diff == 0 ) {
+            apr_uint32_t seen = apr_atomic_cas32( &ring->head, pos + 1, pos );
+            if( seen == pos ) {
+                break;
+            }
+            pos = seen;
+
+        // the drain thread hasn't caught up; drop the event
+        } else if( diff < 0 ) {
+            apr_atomic_inc32( &ring->dropped );
+            return;
+
+        // another thread claimed it first
+        } else {
+            pos = apr_atomic_read32( &ring->head );
+        }
+    }
+
+    cell->record = *record;
+
+    // hand the slot to the drain thread
+    apr_atomic_xchg32( &cell->seq, pos + 1 );
+}
+
+// Take the oldest event off the ring; drain thread only
+static int pop_event( event_ring_t *ring, event_record_t *record )
+{
+    event_cell_t *cell = &ring->cells[ ring->tail & ring->mask ];
+
+    // apr_atomic_read32() is a plain load; a no-op CAS is a full barrier,
+    // so the record can't be read before we know it was written
+    if( apr_atomic_cas32( &cell->seq, 0, 0 ) != ring->tail + 1 ) {
+        return 0;
+    }
+
+    *record = cell->record;
+
+    // hand the slot back to the request threads, for the next lap
+    apr_atomic_xchg32( &cell->seq, ring->tail + ring->mask + 1 );
+    ring->tail++;
+
+    return 1;
+}
+
+// Write a batch of events to the file or socket. Events are dropped if
+// that fails; we never hold up the ring for them.
+static void write_events( event_ring_t *ring, event_record_t *batch, int n )
+{
+    apr_size_t len = n * sizeof(event_record_t);
+    apr_status_t rv;
+
+    if( cookietrack_global.event_file ) {
+        // the file is opened for append, so children don't interleave batches
+        if( (rv = apr_file_write_full( cookietrack_global.event_file,
+                                       batch, len, NULL )) != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, ring->server,
+                          "Can't write %d events to %s", n, cookietrack_global.event_target );
+        }
+
+    } else {
+        struct sockaddr_un addr;
+
+        memset( &addr, 0, sizeof(addr) );
+        addr.sun_family = AF_UNIX;
+        apr_cpystrn( addr.sun_path,
+                     cookietrack_global.event_target + strlen(EVENT_SOCKET_PREFIX),
+                     sizeof(addr.sun_path) );
+
+        // nobody listening is fine; the events are just lost
+        if( sendto( ring->sock, batch, len, 0,
+                    (struct sockaddr *)&addr, sizeof(addr) ) < 0 ) {
+            _DEBUG && fprintf( stderr, "Can't send %d events to %s\n",
+                               n, cookietrack_global.event_target );
+        }
+    }
+}
+
+// The drain thread: write out events in batches until the child exits
+static void * APR_THREAD_FUNC drain_events( apr_thread_t *thread, void *data )
+{
+    event_ring_t *ring = data;
+    event_record_t batch[ EVENT_BATCH ];
+
+    for( ;; ) {
+        int n = 0;
+
+        while( n < EVENT_BATCH && pop_event( ring, &batch[n] ) ) {
+            n++;
+        }
+
+        if( n ) {
+            write_events( ring, batch, n );
+        }
+
+        // more to do right away
+        if( n == EVENT_BATCH ) {
+            continue;
+        }
+
+        // the ring is empty, so if we're asked to stop, we're done
+        if( apr_atomic_read32( &ring->stop ) ) {
+            break;
+        }
+
+        apr_sleep( EVENT_DRAIN_INTERVAL );
+    }
+
+    apr_thread_exit( thread, APR_SUCCESS );
+    return NULL;
+}
+
+// Stop the drain thread when the child exits, after it wrote out what's left.
+// This is a pre cleanup, so it runs before the thread's own pool goes away.
+static apr_status_t stop_events( void *data )
+{
+    event_ring_t *ring = data;
+    apr_status_t rv;
+
+    apr_atomic_set32( &ring->stop, 1 );
+    apr_thread_join( &rv, ring->thread );
+
+    if( ring->sock >= 0 ) {
+        close( ring->sock );
+    }
+
+    if( apr_atomic_read32( &ring->dropped ) ) {
+        ap_log_error( APLOG_MARK, APLOG_WARNING, 0, ring->server,
+                      "Dropped %u events for %s; consider a bigger ring",
+                      apr_atomic_read32( &ring->dropped ), cookietrack_global.event_target );
+    }
+
+    cookietrack_global.events = NULL;
+
+    return APR_SUCCESS;
+}
+
+// Set up this child's event ring and drain thread
+static void start_events( apr_pool_t *p, server_rec *s )
+{
+    event_ring_t *ring = apr_pcalloc( p, sizeof(event_ring_t) );
+    apr_uint32_t i;
+    apr_status_t rv;
+
+    ring->mask   = cookietrack_global.event_ring_size - 1;
+    ring->cells  = apr_pcalloc( p, cookietrack_global.event_ring_size * sizeof(event_cell_t) );
+    ring->server = s;
+    ring->sock   = -1;
+
+    for( i = 0; i <= ring->mask; i++ ) {
+        ring->cells[i].seq = i;
+    }
+
+    if( !cookietrack_global.event_file
+        && (ring->sock = socket( AF_UNIX, SOCK_DGRAM, 0 )) < 0 ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, errno, s,
+                      "Can't create socket for %s", cookietrack_global.event_target );
+        return;
+    }
+
+    if( (rv = apr_thread_create( &ring->thread, NULL, drain_events, ring, p )) != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "Can't start thread for %s", cookietrack_global.event_target );
+        if( ring->sock >= 0 ) {
+            close( ring->sock );
+        }
+        return;
+    }
+
+    apr_pool_pre_cleanup_register( p, ring, stop_events );
+
+    cookietrack_global.events = ring;
+}
+
+// Queue an event for a UID we just generated
+static void log_generated_uid( request_rec *r, const char *uid, const char *ip, int dnt )
+{
+    const char *ua = apr_table_get( r->headers_in, "User-Agent" );
+    event_record_t record;
+
+    memset( &record, 0, sizeof(record) );
+    record.magic     = EVENT_MAGIC;
+    record.length    = sizeof(record);
+    record.dnt       = dnt ? 1 : 0;
+    record.ua_hash   = ua ? sample_hash( SAMPLE_HASH_SEED, ua, strlen(ua) ) : 0;
+    record.timestamp = r->request_time;
+    apr_cpystrn( record.uid, uid, sizeof(record.uid) );
+    apr_cpystrn( record.ip, ip ? ip : "", sizeof(record.ip) );
+
+    push_event( cookietrack_global.events, &record );
+}
+
+#endif
+
+/* ********************************************
+
+    Shared memory sequential UIDs
+
+   ******************************************** */
+
+// Read the id of the current boot into 'boot_id'; it's left empty if the
+// system doesn't have one.
+static void read_boot_id( apr_pool_t *p, char *boot_id, apr_size_t size )
+{
+    apr_file_t *fh;
+    apr_size_t len = 0;
+
+    memset( boot_id, 0, size );
+
+    if( apr_file_open( &fh, SEQUENCE_BOOT_ID, APR_FOPEN_READ,
+                       APR_OS_DEFAULT, p ) != APR_SUCCESS ) {
+        return;
+    }
+
+    // it's shorter than we ask for, so this returns APR_EOF
+    apr_file_read_full( fh, boot_id, size - 1, &len );
+    apr_file_close( fh );
+
+    while( len > 0 && (boot_id[ len - 1 ] == '\n' || boot_id[ len - 1 ] == ' ') ) {
+        boot_id[ --len ] = '\0';
+    }
+}
+
+// Map the sequence file, creating it if needed. Within one boot, the mapped
+// counter outlives any restart or crash of httpd, so we just continue from
+// it. After a reboot, ids leased but not synced before an OS crash may be
+// lost from the file, so we continue from the synced high water mark; that
+// skips up to SEQUENCE_RESERVE blocks of ids, but never hands one out again.
+static apr_status_t open_sequence_store( apr_pool_t *p, server_rec *s )
+{
+    apr_file_t *fh;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_status_t rv;
+    char boot_id[ SEQUENCE_BOOT_ID_LENGTH ];
+
+    if( (rv = apr_file_open( &fh, cookietrack_global.sequence_file,
+                             APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_BINARY,
+                             APR_UREAD | APR_UWRITE, p )) != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "Can't open CookieSequenceFile %s", cookietrack_global.sequence_file );
+        return rv;
+    }
+
+    if( (rv = apr_file_info_get( &finfo, APR_FINFO_SIZE, fh )) == APR_SUCCESS
+        && finfo.size < (apr_off_t)sizeof(sequence_store_t) ) {
+        rv = apr_file_trunc( fh, sizeof(sequence_store_t) );
+    }
+
+    if( rv == APR_SUCCESS ) {
+        rv = apr_mmap_create( &mm, fh, 0, sizeof(sequence_store_t),
+                              APR_MMAP_READ | APR_MMAP_WRITE, p );
+    }
+
+    // the mapping stays valid after the file is closed
+    apr_file_close( fh );
+
+    if( rv != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "Can't mmap CookieSequenceFile %s", cookietrack_global.sequence_file );
+        return rv;
+    }
+
+    sequence_store_t *store = mm->mm;
+
+    // a new file; refuse to start over on a file we don't recognize, as
+    // that could hand out ids again
+    if( store->magic != SEQUENCE_MAGIC ) {
+        if( store->next || store->high_water ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, 0, s,
+                          "CookieSequenceFile %s is not a sequence file",
+                          cookietrack_global.sequence_file );
+            return APR_EGENERAL;
+        }
+        store->magic = SEQUENCE_MAGIC;
+    }
+
+    // A different boot, or one we can't tell apart; 'next' may be behind
+    // ids handed out before. Only ever move forward: on a graceful restart,
+    // old children may still be leasing from this counter.
+    read_boot_id( p, boot_id, sizeof(boot_id) );
+
+    if( !boot_id[0] || strcmp( boot_id, store->boot_id ) != 0 ) {
+        if( store->next < store->high_water ) {
+            _DEBUG && fprintf( stderr, "Sequence skips %" APR_UINT64_T_FMT " ids after a reboot\n",
+                               store->high_water - store->next );
+            store->next = store->high_water;
+        }
+        memcpy( store->boot_id, boot_id, sizeof(boot_id) );
+    }
+
+    // the previous run may have died before its last sync finished
+    msync( store, sizeof(*store), MS_SYNC );
+    if( store->synced < store->high_water ) {
+        store->synced = store->high_water;
+    }
+
+    _DEBUG && fprintf( stderr, "Sequence %s at %" APR_UINT64_T_FMT "\n",
+                       cookietrack_global.sequence_file, store->next );
+
+    cookietrack_global.sequence = store;
+
+    return APR_SUCCESS;
+}
+
+// Sync the high water mark to disk, and record that it is. 'mark' must be
+// read before the msync(), so we never claim more than was written.
+static void sync_sequence_store( sequence_store_t *store, apr_uint64_t mark )
+{
+    apr_uint64_t synced = store->synced;
+
+    msync( store, sizeof(*store), MS_SYNC );
+
+    // never lower it; a later sync may have finished before ours
+    while( synced < mark ) {
+        apr_uint64_t seen = __sync_val_compare_and_swap( &store->synced, synced, mark );
+        if( seen == synced ) {
+            break;
+        }
+        synced = seen;
+    }
+}
+
+// Lease a block of ids from the shared counter. APR only has 64 bit
+// atomics from 1.7 on, so use the gcc builtins.
+static apr_uint64_t lease_sequence_block( void )
+{
+    sequence_store_t *store = cookietrack_global.sequence;
+    apr_uint64_t base       = __sync_fetch_and_add( &store->next, SEQUENCE_BLOCK );
+    apr_uint64_t end        = base + SEQUENCE_BLOCK;
+    apr_uint64_t high_water = store->high_water;
+    int waits               = 0;
+
+    // the common case: these ids are already on disk as leased
+    if( end <= store->synced ) {
+        return base;
+    }
+
+    // Past the high water mark; raise it well ahead, and sync that to disk
+    // before we hand out any of these ids. Happens once per reserve.
+    while( end > high_water ) {
+        apr_uint64_t mark = end + SEQUENCE_RESERVE * SEQUENCE_BLOCK;
+        apr_uint64_t seen = __sync_val_compare_and_swap( &store->high_water, high_water, mark );
+
+        if( seen == high_water ) {
+            sync_sequence_store( store, mark );
+            return base;
+        }
+        high_water = seen;
+    }
+
+    // Another child raised it, but may still be syncing it. Wait for that,
+    // or if it takes too long (it may have died), sync it ourselves.
+    while( store->synced < end ) {
+        if( waits++ < SEQUENCE_SYNC_WAITS ) {
+            apr_sleep( 100 );
+        } else {
+            sync_sequence_store( store, store->high_water );
+        }
+    }
+
+    return base;
+}
+
+// Get the next sequential id. Request threads take ids from this child's
+// block with one atomic increment; only when it runs out is a lock taken,
+// to lease the next one. The previous block is reused for that, so a
+// thread still looking at it either gets a valid id from the new lease,
+// or sees it's used up and tries again.
+static apr_uint64_t next_sequence_id( void )
+{
+    for( ;; ) {
+        sequence_block_t *block = cookietrack_global.block;
+
+        if( block ) {
+            apr_uint32_t used = apr_atomic_inc32( &block->used );
+
+            if( used < SEQUENCE_BLOCK ) {
+                return block->base + used;
+            }
+        }
+
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock( cookietrack_global.lease_mutex );
+#endif
+        // nobody else leased a new block while we waited
+        if( cookietrack_global.block == block ) {
+            sequence_block_t *next = block == &cookietrack_global.blocks[0]
+                                        ? &cookietrack_global.blocks[1]
+                                        : &cookietrack_global.blocks[0];
+
+            next->base = lease_sequence_block();
+            apr_atomic_xchg32( &next->used, 0 );
+            cookietrack_global.block = next;
+
+            _DEBUG && fprintf( stderr, "Leased ids from %" APR_UINT64_T_FMT "\n", next->base );
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock( cookietrack_global.lease_mutex );
+#endif
+    }
+}
+
+// Render a sequential id in base 62; at most 11 characters
+static void format_sequence_id( char uid[], apr_uint64_t id )
+{
+    char buf[ 12 ];
+    int i = sizeof(buf) - 1;
+
+    buf[i] = '\0';
+    do {
+        buf[--i] = SEQUENCE_DIGITS[ id % 62 ];
+        id /= 62;
+    } while( id );
+
+    strcpy( uid, &buf[i] );
+}
 
 /* ********************************************
 
@@ -142,6 +1296,63 @@ void __builtin_gen_uid( char uid[], char input[] )
 
 }
 
+// Hash a string for sampling purposes; FNV-1a, seeded so we can chain
+// multiple inputs together without concatenating them first.
+static apr_uint32_t sample_hash( apr_uint32_t hash, const char *str, apr_size_t len )
+{
+    apr_size_t i;
+
+    for( i = 0; i < len && str[i]; i++ ) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+// The FNV low bits aren't well distributed, so mix them (murmur3
+// finalizer) before taking a sample_hash() modulo anything.
+static apr_uint32_t hash_mix( apr_uint32_t hash )
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+// Is this hash part of the configured sample?
+static int hash_in_sample( cookietrack_settings_rec *dcfg, apr_uint32_t hash )
+{
+    return (hash_mix( hash ) % SAMPLE_SCALE) < (apr_uint32_t)dcfg->sample_rate;
+}
+
+// Generate a new UID for this visitor. This is only called for visitors
+// that are in the sample, and the UID is always taken from the current
+// time: sampling never changes it.
+static void generate_uid( cookietrack_settings_rec *dcfg, char uid[], const char *rname )
+{
+    // dense ids from the shared counter
+    if( dcfg->generator == CT_GEN_SEQUENTIAL && cookietrack_global.sequence ) {
+        format_sequence_id( uid, next_sequence_id() );
+
+    // if we have some sort of library that's generating the
+    // UID, call that with the cookie we would be setting
+    } else if( _EXTERNAL_UID_FUNCTION ) {
+        char ts[ _MAX_COOKIE_LENGTH ];
+        sprintf( ts, "%" APR_TIME_T_FMT, apr_time_now() );
+        gen_uid( uid, ts, rname );
+
+    // otherwise, just set it
+    } else {
+        sprintf( uid, "%s.%" APR_TIME_T_FMT, rname, apr_time_now() );
+    }
+
+    _DEBUG && fprintf( stderr, "Generated UID %s\n", uid );
+}
+
 // Generate the actual cookie
 void make_cookie(request_rec *r, char uid[], char cur_uid[], int use_dnt_expires)
 {   // configuration
@@ -259,25 +1470,136 @@ void make_cookie(request_rec *r, char uid[], char cur_uid[], int use_dnt_expires
                         apr_pstrdup(r->pool, uid) );
     }
 
-    // set a note, so we can capture it in the logs
-    // this expects chars, and apr_pstrdup will make sure any char stays
-    // in scope for the function. If not, it ends up being empty.
-    apr_table_setn( r->notes, dcfg->note_name, apr_pstrdup(r->pool, uid) );
+    // set a note, so we can capture it in the logs
+    // this expects chars, and apr_pstrdup will make sure any char stays
+    // in scope for the function. If not, it ends up being empty.
+    apr_table_setn( r->notes, dcfg->note_name, apr_pstrdup(r->pool, uid) );
+
+}
+
+// Evaluate the CookieTrackingIf conditions. The first matching 'on' or
+// 'off' condition decides whether we track this request; any matching
+// 'dntexempt' condition makes the request DNT exempt. Once a request is
+// switched off, nothing else matters, so we stop there.
+static void eval_tracking_if( request_rec *r, cookietrack_settings_rec *dcfg,
+                              int *enabled, int *force_dnt_exempt )
+{
+#if _HAVE_AP_EXPR
+    int decided = 0;
+    int i;
+
+    for( i = 0; i < dcfg->tracking_if->nelts; i++ ) {
+        tracking_if_rec *cond = &((tracking_if_rec *)dcfg->tracking_if->elts)[i];
+        const char *err       = NULL;
+        int rv;
+
+        // nothing left for this condition to change
+        if( cond->action == CT_IF_DNT_EXEMPT ? *force_dnt_exempt : decided ) {
+            continue;
+        }
+
+        rv = ap_expr_exec( r, cond->expr, &err );
+
+        if( err ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r,
+                           "Can't evaluate CookieTrackingIf expression %s: %s",
+                           cond->expr_string, err );
+            continue;
+        }
+
+        _DEBUG && fprintf( stderr, "CookieTrackingIf %s: %d\n", cond->expr_string, rv );
+
+        if( rv <= 0 ) {
+            continue;
+        }
+
+        if( cond->action == CT_IF_DNT_EXEMPT ) {
+            *force_dnt_exempt = 1;
+        } else {
+            *enabled = (cond->action == CT_IF_ON);
+            decided  = 1;
+
+            if( !*enabled ) {
+                return;
+            }
+        }
+    }
+#endif
+}
+
+// Find the cookie and figure out what to do
+static int spot_cookie(request_rec *r)
+{
+    cookietrack_settings_rec *dcfg = ap_get_module_config(r->per_dir_config,
+                                                &cookietrack_module);
+
+    const char *cookie_header;
+    ap_regmatch_t regm[NUM_SUBS];
+    int enabled          = dcfg->enabled;
+    int force_dnt_exempt = 0;
+
+    /* Do not run in subrequests */
+    if (r->main) {
+        return DECLINED;
+    }
+
+    /* CookieTrackingIf conditions may override CookieTracking for this request */
+    if( dcfg->tracking_if->nelts > 0 ) {
+        eval_tracking_if( r, dcfg, &enabled, &force_dnt_exempt );
+    }
+
+    if( !enabled ) {
+        return DECLINED;
+    }
+
+    /* XFF support inspired by this patch:
+       http://www.mail-archive.com/dev@httpd.apache.org/msg17378.html
+
+       And this implementation for scanning for remote ip:
+       http://apache.wirebrain.de/lxr/source/modules/metadata/mod_remoteip.c?v=2.3-trunk#267
+    */
+
+    // Get the IP address of the originating request
+    const char *rname = NULL;   // Originating IP address
+    char *xff         = NULL;   // X-Forwarded-For, or equivalent header type
+
+    // Should we look at a header?
+    /// apr_table_get returns a const char, so strdup it.
+    if( xff = apr_pstrdup( r->pool, apr_table_get(r->headers_in, dcfg->cookie_ip_header) ) ) {
+
+        // There might be multiple addresses in the header
+        // Check if there's a comma in there somewhere
+
+        // no comma, this is the address we can use
+        if( (rname = strrchr(xff, ',')) == NULL ) {
+            rname = xff;
+
+        // whitespace/commas left, remove 'm
+        } else {
 
-}
+            // move past the comma
+            rname++;
 
-// Find the cookie and figure out what to do
-static int spot_cookie(request_rec *r)
-{
-    cookietrack_settings_rec *dcfg = ap_get_module_config(r->per_dir_config,
-                                                &cookietrack_module);
+            // and any whitespace we might find
+            while( *rname == ' ' ) {
+                rname++;
+            }
+        }
 
-    const char *cookie_header;
-    ap_regmatch_t regm[NUM_SUBS];
+    // otherwise, get it from the remote host
+    } else {
+        rname = ap_get_remote_host( r->connection, r->per_dir_config,
+                                    REMOTE_NAME, NULL );
+    }
 
-    /* Do not run in subrequests */
-    if (!dcfg->enabled || r->main) {
-        return DECLINED;
+    _DEBUG && fprintf( stderr, "Remote Address: %s\n", rname );
+
+    /* Count requests per client ip before anything below declines, so
+       clients that are sampled out, send DNT or an exempt cookie can't
+       hide from it. Those are often the ones minting fresh cookies.
+    */
+    if( dcfg->ip_hitter_threshold && cookietrack_global.ip_hitters ) {
+        detect_ip_hitter( r, dcfg, rname );
     }
 
     /* Do we already have a cookie? */
@@ -335,22 +1657,15 @@ static int spot_cookie(request_rec *r)
 
     _DEBUG && fprintf( stderr, "DNT: %s - DNT Enabled: %d\n", dnt_header_value, dnt_is_set );
 
-    // XXX This doesn't work because SetEnv/SetEnvIf code isn't run until APR_HOOK_MIDDLE,
-    // at which point this code has already run :(
-    // Are you asking us to ignore DNT on this request?
-    // char *dnt_ignored_this_request;
-    // if( apr_env_get( &dnt_ignored_this_request, DNT_IGNORE_ENV_VAR, r->pool ) != APR_SUCCESS ) {
-    //     _DEBUG && fprintf( stderr, "Env var %s not set\n", DNT_IGNORE_ENV_VAR );
-    // } else {
-    //     _DEBUG && fprintf( stderr, "Request is DNT exempt: %s\n", dnt_ignored_this_request );
-    // }
+    // You may have chosen to ignore DNT for this request through CookieTrackingIf.
+    // We don't use an env var for this, as SetEnv isn't run until the fixups
+    // at APR_HOOK_MIDDLE, at which point this code has already run.
+    int request_is_dnt_exempt = force_dnt_exempt;
 
     // You may have chosen to ignore this browsers DNT settings
-    int request_is_dnt_exempt = 0;
-
     // Only bother checking if DNT was set to begin with and we have a list
     // of browser regexes to filter against.
-    if( (dcfg->dnt_exempt_browser->nelts > 0) && dnt_is_set ) {
+    if( (dcfg->dnt_exempt_browser->nelts > 0) && dnt_is_set && !request_is_dnt_exempt ) {
 
         char *ua = NULL;
         if( (ua = apr_pstrdup( r->pool, apr_table_get( r->headers_in, "User-Agent" )) ) ) {
@@ -381,51 +1696,38 @@ static int spot_cookie(request_rec *r)
         }
     }
 
-    /* XFF support inspired by this patch:
-       http://www.mail-archive.com/dev@httpd.apache.org/msg17378.html
-
-       And this implementation for scanning for remote ip:
-       http://apache.wirebrain.de/lxr/source/modules/metadata/mod_remoteip.c?v=2.3-trunk#267
+    /* Are we only tracking a sample of our visitors? If so, decide whether
+       this one is in it, on the inputs we'd generate their UID from: IP
+       address and User-Agent. Only visitors without a tracking cookie (or
+       carrying the DNT value) are sampled; we only hand out UIDs to visitors
+       in the sample, so anyone carrying one stays tracked, and the UID
+       itself is never changed to make it fit the sample.
+       Sampled-out visitors get no cookie, header or note at all.
     */
+    if( dcfg->sample_rate < SAMPLE_SCALE
+        && !(cur_cookie_value && strcasecmp( cur_cookie_value, dcfg->dnt_value ) != 0) ) {
 
-    // Get the IP address of the originating request
-    const char *rname = NULL;   // Originating IP address
-    char *xff         = NULL;   // X-Forwarded-For, or equivalent header type
-
-    // Should we look at a header?
-    /// apr_table_get returns a const char, so strdup it.
-    if( xff = apr_pstrdup( r->pool, apr_table_get(r->headers_in, dcfg->cookie_ip_header) ) ) {
-
-        // There might be multiple addresses in the header
-        // Check if there's a comma in there somewhere
+        const char *ua    = apr_table_get( r->headers_in, "User-Agent" );
+        apr_uint32_t hash = sample_hash( SAMPLE_HASH_SEED, rname, strlen(rname) );
+        int sampled;
 
-        // no comma, this is the address we can use
-        if( (rname = strrchr(xff, ',')) == NULL ) {
-            rname = xff;
+        if( ua ) {
+            hash = sample_hash( hash, ua, strlen(ua) );
+        }
 
-        // whitespace/commas left, remove 'm
-        } else {
+        sampled = hash_in_sample( dcfg, hash );
 
-            // move past the comma
-            rname++;
+        _DEBUG && fprintf( stderr, "Visitor in sample: %d\n", sampled );
 
-            // and any whitespace we might find
-            while( *rname == ' ' ) {
-                rname++;
-            }
+        if( !sampled ) {
+            return DECLINED;
         }
-
-    // otherwise, get it from the remote host
-    } else {
-        rname = ap_get_remote_host( r->connection, r->per_dir_config,
-                                    REMOTE_NAME, NULL );
     }
 
-    _DEBUG && fprintf( stderr, "Remote Address: %s\n", rname );
-
     /* Determine the value of the cookie we're going to set: */
     /* Make sure we have enough room here by adding an extra char of space. */
     char new_cookie_value[ _MAX_COOKIE_LENGTH + 1 ];
+    int uid_generated = 0;
 
     _DEBUG && fprintf( stderr, "Maximum supported cookie length: %d\n", _MAX_COOKIE_LENGTH );
 
@@ -453,18 +1755,9 @@ static int spot_cookie(request_rec *r)
             // but it's set to the DNT cookie
             if( strcasecmp( cur_cookie_value, dcfg->dnt_value ) == 0 ) {
 
-                // if we have some sort of library that's generating the
-                // UID, call that with the cookie we would be setting
-                if( _EXTERNAL_UID_FUNCTION ) {
-                    char ts[ _MAX_COOKIE_LENGTH ];
-                    sprintf( ts, "%" APR_TIME_T_FMT, apr_time_now() );
-                    gen_uid( new_cookie_value, ts, rname );
-
-                // otherwise, just set it
-                } else {
-                    sprintf( new_cookie_value,
-                             "%s.%" APR_TIME_T_FMT, rname, apr_time_now() );
-                }
+                // so generate a fresh one
+                generate_uid( dcfg, new_cookie_value, rname );
+                uid_generated = 1;
 
             // it's set to something reasonable - note we're still setting
             // a new cookie, even when there's no expires requested, because
@@ -482,23 +1775,28 @@ static int spot_cookie(request_rec *r)
         // it's either carbage, or not set; either way,
         // we need to generate a new one
         } else {
-            // if we have some sort of library that's generating the
-            // UID, call that with the cookie we would be setting
-            if( _EXTERNAL_UID_FUNCTION ) {
-                char ts[ _MAX_COOKIE_LENGTH ];
-                sprintf( ts, "%" APR_TIME_T_FMT, apr_time_now() );
-                gen_uid( new_cookie_value, ts, rname );
-
-            // otherwise, just set it
-            } else {
-                sprintf( new_cookie_value,
-                         "%s.%" APR_TIME_T_FMT, rname, apr_time_now() );
-            }
+            generate_uid( dcfg, new_cookie_value, rname );
+            uid_generated = 1;
         }
     }
 
     _DEBUG && fprintf( stderr, "New cookie: %s\n", new_cookie_value );
 
+    /* Remember what we resolved, for other modules to use */
+    cookietrack_request_rec *rrec = apr_pcalloc( r->pool, sizeof(cookietrack_request_rec) );
+    rrec->uid       = apr_pstrdup( r->pool, new_cookie_value );
+    rrec->generated = uid_generated;
+    rrec->dnt       = (dnt_is_set && dcfg->comply_with_dnt && !request_is_dnt_exempt);
+    rrec->client_ip = rname;
+    ap_set_module_config( r->request_config, &cookietrack_module, rrec );
+
+#if APR_HAS_THREADS
+    /* Tell the drain thread about the UID we minted */
+    if( uid_generated && cookietrack_global.events ) {
+        log_generated_uid( r, new_cookie_value, rname, dnt_is_set );
+    }
+#endif
+
     /* Set the cookie in a note, for logging */
     apr_table_setn(r->notes, dcfg->note_name, new_cookie_value);
 
@@ -508,6 +1806,15 @@ static int spot_cookie(request_rec *r)
                     (dnt_is_set && dcfg->comply_with_dnt && !request_is_dnt_exempt)
                 );
 
+    // DNT visitors aren't tracked, so don't record their visits either
+    if( dcfg->track_visits && cookietrack_global.visits && !rrec->dnt ) {
+        publish_visit( r, dcfg, rrec->uid );
+    }
+
+    if( dcfg->uid_hitter_threshold && cookietrack_global.uid_hitters ) {
+        detect_uid_hitter( r, dcfg, rrec );
+    }
+
     // We need to flush the stream for messages to appear right away.
     // Performing an fflush() in a production system is not good for
     // performance - don't do this for real.
@@ -516,6 +1823,138 @@ static int spot_cookie(request_rec *r)
     return OK;                  /* We set our cookie */
 }
 
+/* ********************************************
+
+    Exposing the resolved UID to other modules
+
+   ******************************************** */
+
+// Find what spot_cookie() resolved for this request. We don't run in
+// subrequests, and internal redirects may not have run us again, so walk
+// back to the request we did run in.
+static cookietrack_request_rec *get_request_rec( request_rec *r )
+{
+    while( r ) {
+        cookietrack_request_rec *rrec = ap_get_module_config( r->request_config,
+                                                    &cookietrack_module );
+        if( rrec ) {
+            return rrec;
+        }
+
+        r = r->main ? r->main : r->prev;
+    }
+
+    return NULL;
+}
+
+static const char *cookietrack_uid( request_rec *r )
+{
+    cookietrack_request_rec *rrec = get_request_rec( r );
+    return rrec ? rrec->uid : NULL;
+}
+
+static int cookietrack_uid_generated( request_rec *r )
+{
+    cookietrack_request_rec *rrec = get_request_rec( r );
+    return rrec ? rrec->generated : 0;
+}
+
+static int cookietrack_dnt( request_rec *r )
+{
+    cookietrack_request_rec *rrec = get_request_rec( r );
+    return rrec ? rrec->dnt : 0;
+}
+
+static const char *cookietrack_client_ip( request_rec *r )
+{
+    cookietrack_request_rec *rrec = get_request_rec( r );
+    return rrec ? rrec->client_ip : NULL;
+}
+
+#if _HAVE_AP_EXPR
+
+// The fields we expose to ap_expr, e.g. %{COOKIETRACK_UID} or cookietrack('uid')
+static const char *expr_fields[] = { "UID", "GENERATED", "DNT", "IP", NULL };
+
+// Returns the ap_expr value for field, or NULL if it's not one of ours
+static const char *expr_field_value( request_rec *r, const char *field )
+{
+    cookietrack_request_rec *rrec = get_request_rec( r );
+
+    if( strcasecmp( field, "UID" ) == 0 ) {
+        return rrec ? rrec->uid : "";
+
+    } else if( strcasecmp( field, "GENERATED" ) == 0 ) {
+        return rrec && rrec->generated ? "1" : "0";
+
+    } else if( strcasecmp( field, "DNT" ) == 0 ) {
+        return rrec && rrec->dnt ? "1" : "0";
+
+    } else if( strcasecmp( field, "IP" ) == 0 ) {
+        return rrec ? rrec->client_ip : "";
+    }
+
+    return NULL;
+}
+
+static const char *expr_var_fn( ap_expr_eval_ctx_t *ctx, const void *data )
+{
+    return ctx->r ? expr_field_value( ctx->r, (const char *)data ) : "";
+}
+
+static const char *expr_string_fn( ap_expr_eval_ctx_t *ctx, const void *data,
+                                   const char *arg )
+{
+    const char *value;
+
+    if( !ctx->r ) {
+        return "";
+    }
+
+    if( (value = expr_field_value( ctx->r, arg )) == NULL ) {
+        *ctx->err = apr_psprintf( ctx->p, "Unknown %s() field: %s",
+                                  EXPR_FUNC_NAME, arg );
+        return "";
+    }
+
+    return value;
+}
+
+// Resolve COOKIETRACK_* variables and the cookietrack() function
+static int expr_lookup( ap_expr_lookup_parms *parms )
+{
+    int i;
+
+    switch( parms->type ) {
+    case AP_EXPR_FUNC_VAR:
+        if( strncasecmp( parms->name, EXPR_VAR_PREFIX,
+                         strlen(EXPR_VAR_PREFIX) ) != 0 ) {
+            break;
+        }
+
+        for( i = 0; expr_fields[i]; i++ ) {
+            if( strcasecmp( parms->name + strlen(EXPR_VAR_PREFIX), expr_fields[i] ) == 0 ) {
+                *parms->func = expr_var_fn;
+                *parms->data = expr_fields[i];
+                return OK;
+            }
+        }
+        break;
+
+    case AP_EXPR_FUNC_STRING:
+        if( strcasecmp( parms->name, EXPR_FUNC_NAME ) == 0 ) {
+            *parms->func = expr_string_fn;
+            *parms->data = parms->name;
+            return OK;
+        }
+        break;
+    }
+
+    return DECLINED;
+}
+
+#endif
+
 /* ********************************************
 
     Get / Set / Create settings
@@ -664,6 +2103,12 @@ static void *make_cookietrack_settings(apr_pool_t *p, char *d)
     dcfg->dnt_max_age           = DNT_MAX_AGE;
     dcfg->dnt_exempt            = apr_array_make(p, 2, sizeof(const char*) );
     dcfg->dnt_exempt_browser    = apr_array_make(p, 2, sizeof(const char*) );
+    dcfg->sample_rate           = SAMPLE_SCALE;
+    dcfg->tracking_if           = apr_array_make(p, 2, sizeof(tracking_if_rec) );
+    dcfg->generator             = CT_GEN_DEFAULT;
+    dcfg->track_visits          = 0;
+    dcfg->uid_hitter_threshold  = 0;
+    dcfg->ip_hitter_threshold   = 0;
 
     /* In case the user does not use the CookieName directive,
      * we need to compile the regexp for the default cookie name. */
@@ -704,6 +2149,9 @@ static const char *set_config_enable(cmd_parms *cmd, void *mconfig,
     } else if( strcasecmp(name, "CookieDNTComply") == 0 ) {
         dcfg->comply_with_dnt   = value;
 
+    } else if( strcasecmp(name, "CookieVisitTracking") == 0 ) {
+        dcfg->track_visits      = value;
+
     } else {
         return apr_psprintf(cmd->pool, "No such variable %s", name);
     }
@@ -773,6 +2221,33 @@ static const char *set_config_value(cmd_parms *cmd, void *mconfig,
             return apr_psprintf(cmd->pool, "Invalid %s: %s", name, value);
         }
 
+    /* How to generate new UIDs */
+    } else if( strcasecmp(name, "CookieUIDGenerator") == 0 ) {
+
+        if( strcasecmp(value, "default") == 0 ) {
+            dcfg->generator = CT_GEN_DEFAULT;
+
+        } else if( strcasecmp(value, "sequential") == 0 ) {
+            dcfg->generator = CT_GEN_SEQUENTIAL;
+
+        } else {
+            return apr_psprintf(cmd->pool, "Invalid %s: %s", name, value);
+        }
+
+    /* Percentage of visitors to track */
+    } else if( strcasecmp(name, "CookieSampleRate") == 0 ) {
+        char *end;
+        double rate = strtod( value, &end );
+
+        // NaN compares false against both bounds, so check for it explicitly
+        if( *end != '\0' || !isfinite( rate ) || rate < 0 || rate > 100 ) {
+            return apr_psprintf(cmd->pool,
+                        "%s must be a percentage between 0 and 100: %s", name, value);
+        }
+
+        // store as a fraction of SAMPLE_SCALE, so we don't need floats per request
+        dcfg->sample_rate = (int)(rate * SAMPLE_SCALE / 100 + 0.5);
+
     /* Name of the note to use in the logs */
     } else if( strcasecmp(name, "CookieIPHeader") == 0 ) {
         dcfg->cookie_ip_header  = apr_pstrdup(cmd->pool, value);
@@ -837,6 +2312,230 @@ static const char *set_config_value(cmd_parms *cmd, void *mconfig,
     return NULL;
 }
 
+/* Add a CookieTrackingIf condition; the expression is parsed once, here */
+static const char *set_tracking_if(cmd_parms *cmd, void *mconfig,
+                                   const char *action, const char *expr)
+{
+#if _HAVE_AP_EXPR
+    cookietrack_settings_rec *dcfg = mconfig;
+    tracking_if_rec *cond          = apr_array_push(dcfg->tracking_if);
+    const char *err                = NULL;
+
+    if( strcasecmp(action, "on") == 0 ) {
+        cond->action = CT_IF_ON;
+
+    } else if( strcasecmp(action, "off") == 0 ) {
+        cond->action = CT_IF_OFF;
+
+    } else if( strcasecmp(action, "dntexempt") == 0 ) {
+        cond->action = CT_IF_DNT_EXEMPT;
+
+    } else {
+        return apr_psprintf(cmd->pool,
+                    "%s action must be one of on, off or dntexempt: %s",
+                    cmd->cmd->name, action);
+    }
+
+    cond->expr_string = apr_pstrdup(cmd->pool, expr);
+    cond->expr        = ap_expr_parse_cmd(cmd, expr, 0, &err, NULL);
+
+    if( err ) {
+        return apr_psprintf(cmd->pool, "Can't parse %s expression %s: %s",
+                            cmd->cmd->name, expr, err);
+    }
+
+    _DEBUG && fprintf( stderr, "tracking if = %s %s\n", action, expr );
+
+    return NULL;
+#else
+    return apr_psprintf(cmd->pool, "%s requires Apache 2.4 or later", cmd->cmd->name);
+#endif
+}
+
+/* Set up the shared memory visit store; server wide */
+static const char *set_visit_store(cmd_parms *cmd, void *mconfig,
+                                   const char *file, const char *slots)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if( err ) {
+        return err;
+    }
+
+    cookietrack_global.visit_file  = ap_server_root_relative(cmd->pool, file);
+    cookietrack_global.visit_slots = slots ? atoi(slots) : VISIT_SLOTS;
+
+    if( cookietrack_global.visit_slots < VISIT_WAYS ) {
+        return apr_psprintf(cmd->pool, "%s needs at least %d slots",
+                            cmd->cmd->name, VISIT_WAYS);
+    }
+
+    return NULL;
+}
+
+/* Set up the heavy hitter sketches; server wide */
+static const char *set_hitter_sketch(cmd_parms *cmd, void *mconfig,
+                                     const char *width, const char *topk,
+                                     const char *window)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if( err ) {
+        return err;
+    }
+
+    cookietrack_global.hitter_width  = atoi(width);
+    cookietrack_global.hitter_topk   = topk   ? atoi(topk)   : HITTER_TOPK;
+    cookietrack_global.hitter_window = window ? atoi(window) : HITTER_WINDOW;
+
+    if( cookietrack_global.hitter_width  <= 0
+        || cookietrack_global.hitter_topk   <= 0
+        || cookietrack_global.hitter_window <= 0 ) {
+        return apr_psprintf(cmd->pool, "%s values must be positive numbers",
+                            cmd->cmd->name);
+    }
+
+    return NULL;
+}
+
+/* Requests per window at which we flag UIDs and client ips */
+static const char *set_hitter_threshold(cmd_parms *cmd, void *mconfig,
+                                        const char *uid, const char *ip)
+{
+    cookietrack_settings_rec *dcfg = mconfig;
+
+    dcfg->uid_hitter_threshold = atoi(uid);
+    dcfg->ip_hitter_threshold  = ip ? atoi(ip) : 0;
+
+    if( dcfg->uid_hitter_threshold < 0 || dcfg->ip_hitter_threshold < 0 ) {
+        return apr_psprintf(cmd->pool, "%s values must not be negative",
+                            cmd->cmd->name);
+    }
+
+    return NULL;
+}
+
+/* Set up the event stream of generated UIDs; server wide */
+static const char *set_event_log(cmd_parms *cmd, void *mconfig,
+                                 const char *target, const char *size)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if( err ) {
+        return err;
+    }
+
+#if APR_HAS_THREADS
+    if( strncmp(target, EVENT_SOCKET_PREFIX, strlen(EVENT_SOCKET_PREFIX)) == 0 ) {
+        cookietrack_global.event_target = apr_pstrdup(cmd->pool, target);
+    } else {
+        cookietrack_global.event_target = ap_server_root_relative(cmd->pool, target);
+    }
+
+    cookietrack_global.event_ring_size = size ? atoi(size) : EVENT_RING_SIZE;
+
+    // the ring indexes by masking, so it must be a power of 2
+    if( cookietrack_global.event_ring_size <= 0
+        || (cookietrack_global.event_ring_size & (cookietrack_global.event_ring_size - 1)) ) {
+        return apr_psprintf(cmd->pool, "%s ring size must be a power of 2: %s",
+                            cmd->cmd->name, size);
+    }
+
+    return NULL;
+#else
+    return apr_psprintf(cmd->pool, "%s requires APR with thread support", cmd->cmd->name);
+#endif
+}
+
+/* Set up the shared sequential UID counter; server wide */
+static const char *set_sequence_file(cmd_parms *cmd, void *mconfig,
+                                     const char *file)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if( err ) {
+        return err;
+    }
+
+    cookietrack_global.sequence_file = ap_server_root_relative(cmd->pool, file);
+
+    return NULL;
+}
+
+/* ********************************************
+
+    Server wide setup
+
+   ******************************************** */
+
+/* Forget server wide settings from a previous config read; a restart
+   re-reads the config, and the directive may have been removed. */
+static int cookietrack_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                  apr_pool_t *ptemp)
+{
+    memset( &cookietrack_global, 0, sizeof(cookietrack_global) );
+
+    return OK;
+}
+
+/* Set up shared memory; the children inherit it */
+static int cookietrack_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                   apr_pool_t *ptemp, server_rec *s)
+{
+    if( cookietrack_global.visit_file
+        && open_visit_store( pconf, s ) != APR_SUCCESS ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if( cookietrack_global.hitter_width
+        && open_hitter_sketches( pconf, s ) != APR_SUCCESS ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if( cookietrack_global.sequence_file
+        && open_sequence_store( pconf, s ) != APR_SUCCESS ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* open the event file as root, like log files; the children inherit it */
+    if( cookietrack_global.event_target
+        && strncmp( cookietrack_global.event_target, EVENT_SOCKET_PREFIX,
+                    strlen(EVENT_SOCKET_PREFIX) ) != 0 ) {
+        apr_status_t rv = apr_file_open( &cookietrack_global.event_file,
+                                         cookietrack_global.event_target,
+                                         APR_FOPEN_WRITE | APR_FOPEN_APPEND
+                                         | APR_FOPEN_CREATE | APR_FOPEN_BINARY,
+                                         APR_OS_DEFAULT, pconf );
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "Can't open CookieEventLog %s", cookietrack_global.event_target );
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    return OK;
+}
+
+/* Per child setup, e.g. the event drain thread */
+static void cookietrack_child_init(apr_pool_t *pchild, server_rec *s)
+{
+#if APR_HAS_THREADS
+    if( cookietrack_global.event_target ) {
+        start_events( pchild, s );
+    }
+
+    if( cookietrack_global.sequence ) {
+        apr_status_t rv = apr_thread_mutex_create( &cookietrack_global.lease_mutex,
+                                                   APR_THREAD_MUTEX_DEFAULT, pchild );
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "Can't create mutex for sequential UIDs; using the default generator" );
+            cookietrack_global.sequence = NULL;
+        }
+    }
+#endif
+}
+
 /* ********************************************
 
     Registering variables, hooks, etc
@@ -875,6 +2574,24 @@ static const command_rec cookietrack_cmds[] = {
                   "list of cookie values that will not be changed to DNT" ),
     AP_INIT_ITERATE( "CookieDNTExemptBrowsers", set_config_value,   NULL, OR_FILEINFO,
                   "list regular expressions of browsers whose DNT setting will be ignored" ),
+    AP_INIT_TAKE2("CookieTrackingIf",       set_tracking_if,    NULL, OR_FILEINFO,
+                  "'on', 'off' or 'dntexempt', followed by an expression to match the request against"),
+    AP_INIT_TAKE12("CookieVisitStore",      set_visit_store,    NULL, RSRC_CONF,
+                  "file to keep per UID visit counts in, and optionally the number of UIDs to keep"),
+    AP_INIT_FLAG( "CookieVisitTracking",    set_config_enable,  NULL, OR_FILEINFO,
+                  "whether or not to record visits and set visit notes & headers"),
+    AP_INIT_TAKE13("CookieHeavyHitterSketch", set_hitter_sketch, NULL, RSRC_CONF,
+                  "counters per sketch row, and optionally the top K size and window in seconds"),
+    AP_INIT_TAKE12("CookieHeavyHitterThreshold", set_hitter_threshold, NULL, OR_FILEINFO,
+                  "requests per window to flag a UID, and optionally a client ip, as heavy hitter"),
+    AP_INIT_TAKE12("CookieEventLog",        set_event_log,      NULL, RSRC_CONF,
+                  "file or unix:/socket to stream generated UIDs to, and optionally the ring size"),
+    AP_INIT_TAKE1("CookieSequenceFile",     set_sequence_file,  NULL, RSRC_CONF,
+                  "file to keep the sequential UID counter in"),
+    AP_INIT_TAKE1("CookieUIDGenerator",     set_config_value,   NULL, OR_FILEINFO,
+                  "'default' or 'sequential'"),
+    AP_INIT_TAKE1("CookieSampleRate",       set_config_value,   NULL, OR_FILEINFO,
+                  "percentage of visitors to track, e.g. 12.5"),
     {NULL}
 };
 
@@ -884,6 +2601,24 @@ static void register_hooks(apr_pool_t *p)
        http://svn.apache.org/viewvc?view=revision&revision=1154620
     */
     ap_hook_fixups( spot_cookie, NULL, NULL, APR_HOOK_REALLY_FIRST );
+
+    /* server wide setup, e.g. shared memory */
+    ap_hook_pre_config( cookietrack_pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_post_config( cookietrack_post_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_child_init( cookietrack_child_init, NULL, NULL, APR_HOOK_MIDDLE );
+
+    /* show the heavy hitters */
+    ap_hook_handler( hitter_status_handler, NULL, NULL, APR_HOOK_MIDDLE );
+
+    /* let other modules get at the UID we resolved */
+    APR_REGISTER_OPTIONAL_FN( cookietrack_uid );
+    APR_REGISTER_OPTIONAL_FN( cookietrack_uid_generated );
+    APR_REGISTER_OPTIONAL_FN( cookietrack_dnt );
+    APR_REGISTER_OPTIONAL_FN( cookietrack_client_ip );
+
+#if _HAVE_AP_EXPR
+    ap_hook_expr_lookup( expr_lookup, NULL, NULL, APR_HOOK_MIDDLE );
+#endif
 }
 
 module AP_MODULE_DECLARE_DATA cookietrack_module = {
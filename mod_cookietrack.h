@@ -0,0 +1,50 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Optional functions exported by mod_cookietrack, so other modules can
+ * use the UID it resolved for a request without parsing the Cookie header
+ * or looking up notes by name again. Retrieve them in your module's
+ * optional_fn_retrieve hook like this:
+ *
+ *   static APR_OPTIONAL_FN_TYPE(cookietrack_uid) *ct_uid = NULL;
+ *   ct_uid = APR_RETRIEVE_OPTIONAL_FN(cookietrack_uid);
+ *
+ * The functions look at the main request for subrequests, and at the
+ * original request for internal redirects.
+ */
+
+#ifndef MOD_COOKIETRACK_H
+#define MOD_COOKIETRACK_H
+
+#include "apr_optional.h"
+#include "httpd.h"
+
+// The UID set for this request, or NULL if mod_cookietrack did not act on it.
+// This is the DNT value if the request is Do Not Track.
+APR_DECLARE_OPTIONAL_FN(const char *, cookietrack_uid, (request_rec *r));
+
+// 1 if a new UID was generated on this request; 0 if the client sent it,
+// or if the DNT value was set instead.
+APR_DECLARE_OPTIONAL_FN(int, cookietrack_uid_generated, (request_rec *r));
+
+// 1 if Do Not Track was honored for this request, 0 otherwise.
+APR_DECLARE_OPTIONAL_FN(int, cookietrack_dnt, (request_rec *r));
+
+// The client IP, taken from CookieIPHeader if configured, or NULL if
+// mod_cookietrack did not act on this request.
+APR_DECLARE_OPTIONAL_FN(const char *, cookietrack_client_ip, (request_rec *r));
+
+#endif
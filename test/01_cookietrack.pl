@@ -17,6 +17,7 @@ my $Debug       = 0;
 my $CookieLen   = '24,36'; # default length is 24 to 36 chars: $ip.$microtime
 my $XFFSupport  = 1;
 my $TestPattern = '.*'; # run any tests
+my $EventLog    = 'test/events.bin'; # CookieEventLog, relative to the ServerRoot
 
 ### Maximum size of cookies - make sure we get at least that much data back
 ### for longer cookies. 40 is the default in mod_cookietrack.c. Change that,
@@ -30,6 +31,7 @@ GetOptions(
     'maxcookielength=s' => \$CookieMaxLen,
     'xff=i'             => \$XFFSupport,
     'tests=s'           => \$TestPattern,
+    'eventlog=s'        => \$EventLog,
 );
 
 ### make sure we have a cookie the lenght of the default cookie
@@ -69,6 +71,15 @@ my $LCookie = $DName .'='. $LValue . $CAttr;
 my $IE9     = 'Mozilla/5.0 (compatible; MSIE 9.0; Windows NT 6.1; Trident/5.0)';
 my $IE10    = 'Mozilla/5.0 (compatible; MSIE 10.0; Windows NT 6.2; WOW64; Trident/6.0)';
 
+### Visitors in and out of the sample for CookieSampleRate 12.5. Only
+### visitors without a cookie are sampled, so the UIDs can be anything.
+my $SampleUA      = 'Sampled';
+my $SampledIn     = '10.0.0.8';
+my $SampledOut    = '10.0.0.1';
+my $SampledInUID  = '10.0.0.1.0000000000000006';
+my $SampledOutUID = '10.0.0.1.0000000000000000';
+my $SampledOutSeq = 'Seq1';
+
 ### https://github.com/jib/mod_cookietrack/issues/4
 ### Cookies that are too long cause buffer overflows on Centos
 my $B4name   = $DName;
@@ -306,6 +317,149 @@ my %Map     = (
             domain          => $AllUnset,
         },
     },
+    ### module turned on, but nobody is part of the sample
+    sample_none => {
+        use_cookie          => $DCookie,
+        headers => {
+            $DHeader        => $AllUnset,
+            "Set-Cookie"    => $AllUnset,
+        },
+    },
+    ### one in eight new visitors is sampled. These addresses were picked
+    ### because they hash into (and out of) the sample for this UA.
+    sample_fraction => {
+        send_headers        => [ 'X-Forwarded-For' => $SampledIn,
+                                 'User-Agent'      => $SampleUA ],
+        use_cookie          => "$DName=$SampledInUID$CAttr",
+        cookies => {        # COOKIE NO             YES
+            $DName          => [ [ qr/^\Q$SampledIn./, $SampledInUID ], # DNT OFF
+                                 [ "DNT",               "DNT"         ], # DNT ON
+                               ],
+        },
+    },
+    'sample_fraction?out' => {
+        send_headers        => [ 'X-Forwarded-For' => $SampledOut,
+                                 'User-Agent'      => $SampleUA ],
+        use_cookie          => "$DName=$SampledOutUID$CAttr",
+        cookies => {        # COOKIE NO     YES
+            $DName          => [ [ undef,   $SampledOutUID ], # DNT OFF
+                                 [ undef,   "DNT"          ], # DNT ON
+                               ],
+        },
+    },
+    ### module turned on, but switched off by CookieTrackingIf
+    tracking_if_off => {
+        send_headers        => [ 'X-No-Track' => 1 ],
+        use_cookie          => $DCookie,
+        headers => {
+            $DHeader        => $AllUnset,
+            "Set-Cookie"    => $AllUnset,
+        },
+    },
+    ### DNT is ignored for msie 10 through CookieTrackingIf
+    tracking_if_dnt_exempt => {
+        send_headers        => [ 'User-Agent' => $IE10 ],
+        use_cookie          => $DCookie,
+        cookies => {        # COOKIE NO     YES
+            $DName          => [ [ $CookieRe, $CValue ], # DNT OFF
+                                 [ $CookieRe, $CValue ], # DNT ON
+                               ],
+        },
+    },
+    ### visit counts are sent along, but not for DNT requests
+    visits => {
+        use_cookie          => $DCookie,
+        headers => {
+            $DHeader        => [ [ $CookieRe, $CValue ],
+                                 [ "DNT",    "DNT"  ],
+                               ],
+            "$DHeader-Visits"
+                            => [ [ qr/^\d+$/, qr/^\d+$/ ],
+                                 [ undef,     undef     ],
+                               ],
+            "$DHeader-First-Seen"
+                            => [ [ qr/^\d+$/, qr/^\d+$/ ],
+                                 [ undef,     undef     ],
+                               ],
+        },
+    },
+    ### heavy hitter counting doesn't change the cookie
+    heavy_hitters => {
+        use_cookie          => $DCookie,
+        cookies => {        # COOKIE NO     YES
+            $DName          => [ [ $CookieRe, $CValue ], # DNT OFF
+                                 [ "DNT",    "DNT"   ], # DNT ON
+                               ],
+        },
+    },
+    ### with a threshold of 1, every request is flagged; DNT requests
+    ### aren't counted per UID
+    heavy_hitters_flagged => {
+        use_cookie          => $DCookie,
+        headers => {        # COOKIE NO     YES
+            "X-Heavy-Hitter"
+                            => [ [ "uid ip", "uid ip" ], # DNT OFF
+                                 [ "ip",     "ip"     ], # DNT ON
+                               ],
+        },
+    },
+    ### requests we set no cookie for are still counted per client ip
+    heavy_hitters_no_dnt_cookie => {
+        use_cookie          => $DCookie,
+        headers => {        # COOKIE NO     YES
+            "X-Heavy-Hitter"
+                            => [ [ "uid ip", "uid ip" ], # DNT OFF
+                                 [ "ip",     "ip"     ], # DNT ON
+                               ],
+        },
+        cookies => {
+            $DName          => [ [ $CookieRe, $CValue ], # DNT OFF
+                                 [ undef,     undef   ], # DNT ON
+                               ],
+        },
+    },
+    ### the status handler lists the heavy hitters, and sets no cookie
+    'cookietrack-status' => {
+        response_code       => 200,
+        headers => {
+            "Set-Cookie"    => $AllUnset,
+        },
+    },
+    ### the UID is available to mod_headers as %{COOKIETRACK_UID}
+    expr_uid => {
+        use_cookie          => $DCookie,
+        headers => {        # COOKIE NO     YES
+            "X-Visitor"     => [ [ $CookieRe, $CValue ], # DNT OFF
+                                 [ "DNT",     "DNT"   ], # DNT ON
+                               ],
+        },
+        cookies => {
+            $DName          => [ [ $CookieRe, $CValue ], # DNT OFF
+                                 [ "DNT",     "DNT"   ], # DNT ON
+                               ],
+        },
+    },
+    ### sequential ids are base 62, and at most 11 chars
+    sequential => {
+        use_cookie          => $DCookie,
+        cookies => {        # COOKIE NO     YES
+            $DName          => [ [ qr/^[0-9A-Za-z]{1,11}$/, $CValue ], # DNT OFF
+                                 [ "DNT",                  "DNT"   ], # DNT ON
+                               ],
+        },
+    },
+    ### visitors that already carry a sequential id stay tracked, even
+    ### from an address that is sampled out
+    sequential_sample => {
+        send_headers        => [ 'X-Forwarded-For' => $SampledOut,
+                                 'User-Agent'      => $SampleUA ],
+        use_cookie          => "$DName=$SampledOutSeq$CAttr",
+        cookies => {        # COOKIE NO     YES
+            $DName          => [ [ undef,   $SampledOutSeq ], # DNT OFF
+                                 [ undef,   "DNT"          ], # DNT ON
+                               ],
+        },
+    },
     ### test alternate cookie styles - testing code mostly copied
     ### from basic_expires, but adding domain tests.
     basic_expires_cookie => {
@@ -511,6 +665,88 @@ if( $XFFSupport ) {
     }
 }
 
+### %{COOKIETRACK_UID} must be the UID we just generated, too
+if( 'expr_uid' =~ qr/$TestPattern/ ) {
+    my $ua  = LWP::UserAgent->new();
+    my $res = $ua->get( "$Base/expr_uid" );
+    my %cookie = _simple_cookie_parse( $res->header( 'Set-Cookie' ) );
+
+    like( $cookie{ $DName }, $CookieRe,  "Generated UID on /expr_uid" );
+    is( $res->header( 'X-Visitor' ), $cookie{ $DName },
+                                        "   X-Visitor matches the cookie" );
+}
+
+### A UID generated for a sampled visitor must stay tracked, even when the
+### visitor comes back from an address that isn't in the sample.
+if( 'sample_fraction' =~ qr/$TestPattern/ ) {
+    my $ua  = LWP::UserAgent->new();
+    my $url = "$Base/sample_fraction";
+
+    my $res = $ua->get( $url, 'X-Forwarded-For' => $SampledIn,
+                              'User-Agent'      => $SampleUA );
+    my %cookie = _simple_cookie_parse( $res->header( 'Set-Cookie' ) );
+    my $uid    = $cookie{ $DName };
+
+    like( $uid, qr/^\Q$SampledIn./,  "Generated UID for a sampled visitor" );
+
+    $res = $ua->get( $url, 'X-Forwarded-For' => $SampledOut,
+                           'User-Agent'      => $SampleUA,
+                           Cookie            => "$DName=" . ( $uid || '' ) );
+    %cookie = _simple_cookie_parse( $res->header( 'Set-Cookie' ) );
+
+    is( $cookie{ $DName }, $uid,        "   Still sampled when it comes back" );
+}
+
+### Every UID we mint is streamed to the CookieEventLog. Records are
+### fixed size, in host byte order: magic, ua_hash, timestamp, length,
+### dnt, reserved, uid, ip. 'length' is the record size for this build.
+if( $XFFSupport && 'events' =~ qr/$TestPattern/ ) {
+    my $ua  = LWP::UserAgent->new( agent => 'EventTest' );
+    my $ip  = '3.3.3.3';
+
+    my $res = $ua->get( "$Base/xff", 'X-Forwarded-For' => $ip );
+    my %cookie = _simple_cookie_parse( $res->header( 'Set-Cookie' ) );
+    my $uid    = $cookie{ $DName } || '';
+
+    like( $uid, qr/^\Q$ip./,           "Minted a UID for the event log" );
+
+    ### the drain thread writes out every 100ms
+    sleep 1;
+
+    my $data = do {
+        local $/;
+        open my $fh, '<', $EventLog or die "Can't open $EventLog: $!";
+        binmode $fh;
+        <$fh>;
+    };
+    ### the uid field holds _MAX_COOKIE_LENGTH chars and a NUL
+    my $template = 'L L q S C C Z' . ( $CookieMaxLen + 1 ) . ' Z47';
+    my( undef, undef, undef, $len ) = unpack $template, $data;
+
+    ok( $len,                           "   Event log has records" );
+    is( length( $data ) % ( $len || 1 ), 0,
+                                        "   Event log holds whole records of $len bytes" );
+
+    my( $found, $bad ) = ( 0, 0 );
+    for( my $off = 0; $len && $off + $len <= length $data; $off += $len ) {
+        my( $magic, $ua_hash, $ts, $rlen, $dnt, undef, $ruid, $rip )
+            = unpack $template, substr( $data, $off, $len );
+
+        $bad++ if $magic != 0x43544531 || $rlen != $len || !length $ruid;
+
+        if( $ruid eq $uid ) {
+            $found++;
+            is( $rip, $ip,                  "   Event has the client ip" );
+            is( $dnt, 0,                    "   Event has no DNT" );
+            cmp_ok( abs( $ts / 1_000_000 - time ), '<', 60,
+                                            "   Event has a recent timestamp" );
+        }
+    }
+
+    is( $bad, 0,                        "   All events have the magic, length and a UID" );
+    is( $found, 1,                      "   Event for $uid written once" );
+}
+
 sub _do_test {
     my $endpoint    = shift;
     my $dnt_set     = shift;
@@ -0,0 +1,86 @@
+#!/usr/bin/perl
+
+### Tests cookietrack_logscan against test/logscan.log; build it first
+### using 'perl build.pl --tools'.
+
+use strict;
+use warnings;
+use Test::More      'no_plan';
+use FindBin;
+use Getopt::Long;
+
+my $Bin     = "$FindBin::Bin/../cookietrack_logscan";
+my $Log     = "$FindBin::Bin/logscan.log";
+my $Debug   = 0;
+
+GetOptions(
+    'bin=s'     => \$Bin,
+    'debug'     => \$Debug,
+);
+
+ok( -x $Bin,                    "Found $Bin" ) or exit 1;
+
+### Same results, no matter how many threads split up the log
+my %Out;
+for my $threads ( 1, 2, 7 ) {
+    my $out = `$Bin -t $threads $Log`;
+    diag $out if $Debug;
+
+    is( $?, 0,                  "Scanned log with $threads threads" );
+    $Out{ $threads } = $out;
+}
+is( $Out{2}, $Out{1},           "   2 threads match 1 thread" );
+is( $Out{7}, $Out{1},           "   7 threads match 1 thread" );
+
+{   my $out = $Out{1};
+
+    like( $out, qr/^lines: 11$/m,               "   All lines read" );
+    like( $out, qr/^lines with a uid: 9$/m,     "   DNT & missing UIDs skipped" );
+    like( $out, qr/^\s+builtin\s+3$/m,          "   Minted builtin UIDs" );
+    like( $out, qr/^\s+legacy\s+1$/m,           "   Minted legacy UIDs" );
+    like( $out, qr/^\s+sequential\s+1$/m,       "   Minted sequential UIDs" );
+    like( $out, qr/^\s+2016-06-14\s+2$/m,       "   First seen on day 1" );
+    like( $out, qr/^\s+2016-06-15\s+3$/m,       "   First seen on day 2" );
+    like( $out, qr/^\s+2\.2\.2\.2\s+1$/m,       "   Right most XFF ip" );
+    like( $out, qr/^\s+3\.3\.3\.3\s+1$/m,       "   Sequential UID ip from XFF" );
+    like( $out, qr/^\s+127\.0\.0\.1\s+1$/m,     "   Returning visitors not counted" );
+    unlike( $out, qr/^\s+4\.4\.4\.4\s/m,        "   Nor their new ip" );
+}
+
+### Counting every UID, rather than minted UIDs only. Each is still counted
+### once; sequential UIDs at the earliest time they were seen.
+my %All;
+for my $threads ( 1, 2, 7 ) {
+    my $out = `$Bin -a -H -t $threads $Log`;
+    diag $out if $Debug;
+
+    $All{ $threads } = $out;
+}
+is( $All{2}, $All{1},           "All UIDs with 2 threads match 1 thread" );
+is( $All{7}, $All{1},           "All UIDs with 7 threads match 1 thread" );
+
+{   my $out = $All{1};
+
+    like( $out, qr/^\s+builtin\s+3$/m,          "   Distinct builtin UIDs" );
+    like( $out, qr/^\s+sequential\s+2$/m,       "   Distinct sequential UIDs" );
+    like( $out, qr/^\s+127\.0\.0\.1\s+1$/m,     "   Per ip" );
+    like( $out, qr/^\s+3\.3\.3\.3\s+1$/m,       "   Sequential UID at its minting ip" );
+    like( $out, qr/^\s+6\.6\.6\.6\s+1$/m,       "   Sequential UID at its earliest ip" );
+    unlike( $out, qr/^\s+[45]\.[45]\.[45]\.[45]\s/m, "   Not at later ips" );
+    like( $out, qr/^\s+2016-06-14T20\s+2$/m,    "   Per hour" );
+    like( $out, qr/^\s+2016-06-15T20\s+4$/m,    "   Per hour, day 2" );
+}
+
+### Decoding single UIDs
+{   my %map = (
+        '1.2.3.4.1465936070123456'  => qr/\tbuiltin\tfirst_seen=2016-06-14T20:27:50Z\tip=1\.2\.3\.4$/,
+        '1.2.3.4.1465936070123'     => qr/\tlegacy\tfirst_seen=2016-06-14T20:27:50Z\tip=1\.2\.3\.4$/,
+        '1.2.3.4.1465936070'        => qr/\tlegacy\tfirst_seen=2016-06-14T20:27:50Z\tip=1\.2\.3\.4$/,
+        'G7'                        => qr/\tsequential\tid=999$/,
+    );
+
+    while( my( $uid, $re ) = each %map ) {
+        my $out = `$Bin -u $uid`;
+        like( $out, $re,        "Decoded $uid" );
+    }
+}
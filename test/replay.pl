@@ -0,0 +1,257 @@
+#!/usr/bin/perl
+
+### Replays access logs written in the 'cookietrack' LogFormat (see
+### test/conf/httpd.conf.base) against two or more running Apache builds,
+### and reports every request for which the response headers differ from
+### those of the first build. It also reports the throughput and latency
+### percentiles of each build. These are end-to-end numbers: they include
+### httpd, the backend and this client, so they only show a difference in
+### mod_cookietrack when it is large enough to stand out from all of that.
+
+use strict;
+use warnings;
+use Getopt::Long;
+use HTTP::Tiny;
+use File::Temp      qw[tempdir];
+use Time::HiRes     qw[time];
+
+my @Bases;
+my @Headers;
+my $NotesHeader = 'X-Cookietrack-Notes';
+my $Workers     = 4;
+my $Limit       = 0;    # replay at most this many requests; 0 for all
+my $MaxDiffs    = 20;   # differences to print
+my $Debug       = 0;
+
+GetOptions(
+    'base=s'            => \@Bases,
+    'header=s'          => \@Headers,
+    'notes-header=s'    => \$NotesHeader,
+    'workers=i'         => \$Workers,
+    'limit=i'           => \$Limit,
+    'diffs=i'           => \$MaxDiffs,
+    'debug'             => \$Debug,
+) or die usage();
+
+die usage() unless @Bases >= 2 && @ARGV;
+
+### Response headers to compare between builds. Notes aren't visible over
+### HTTP, so have the builds echo them in a header; see the README.
+@Headers = ( 'Set-Cookie', 'X-UUID', $NotesHeader ) unless @Headers;
+
+my @Logs    = @ARGV;
+my $TmpDir  = tempdir( CLEANUP => 1 );
+
+### keep our output in order with the warnings
+$| = 1;
+
+for my $idx ( 0 .. $#Bases ) {
+    my $stats = _replay( $idx, $Bases[ $idx ] );
+
+    printf "build %d %s: %d requests, %d errors\n",
+        $idx, $Bases[ $idx ], $stats->{requests}, $stats->{errors};
+
+    printf "build %d end-to-end: %.1f requests/s, latency ms p50 %.2f ".
+           "p90 %.2f p99 %.2f\n",
+        $idx, $stats->{rate}, map { $_ * 1000 } @{ $stats->{latency} }
+        if $stats->{requests};
+
+    warn "build $idx never sent the $NotesHeader header, so UIDs it ".
+         "generated can't be masked and will show up as differences\n"
+        if $stats->{requests} && !$stats->{notes};
+}
+
+### Compare every build to the first one
+my $Diffs = 0;
+for my $idx ( 1 .. $#Bases ) {
+    $Diffs += _compare( 0, $idx );
+}
+
+exit( $Diffs ? 1 : 0 );
+
+### Replay the logs against one build, with $Workers processes. Each worker
+### takes every $Workers'th request, and writes its results to its own file,
+### in log order, so builds can be compared line by line afterwards.
+sub _replay {
+    my $idx     = shift;
+    my $base    = shift;
+    my $start   = time;
+    my @pids;
+
+    for my $worker ( 0 .. $Workers - 1 ) {
+        my $pid = fork;
+        die "Can't fork: $!" unless defined $pid;
+
+        if( $pid ) {
+            push @pids, $pid;
+            next;
+        }
+
+        _worker( $idx, $base, $worker );
+        exit 0;
+    }
+
+    waitpid( $_, 0 ) for @pids;
+
+    my $elapsed = time - $start;
+    my %stats   = ( requests => 0, errors => 0, notes => 0 );
+    my @times;
+
+    for my $worker ( 0 .. $Workers - 1 ) {
+        open my $fh, '<', _result_file( $idx, $worker ) or die $!;
+        while( <$fh> ) {
+            my( undef, $code, $time, $notes ) = split /\t/;
+            push @times, $time;
+            $stats{requests}++;
+            $stats{errors}++ if $code >= 599;   # HTTP::Tiny's internal errors
+            $stats{notes}++  if $notes;
+        }
+    }
+
+    @times = sort { $a <=> $b } @times;
+
+    $stats{rate}    = $elapsed ? @times / $elapsed : 0;
+    $stats{latency} = [ map { $times[ int( $#times * $_ / 100 ) ] } 50, 90, 99 ];
+
+    return \%stats;
+}
+
+sub _worker {
+    my $idx     = shift;
+    my $base    = shift;
+    my $worker  = shift;
+    my $http    = HTTP::Tiny->new( keep_alive => 1, max_redirect => 0 );
+    my $n       = 0;
+
+    open my $out, '>', _result_file( $idx, $worker ) or die $!;
+
+    for my $log ( @Logs ) {
+        open my $in, '<', $log or die "Can't open $log: $!";
+
+        while( my $line = <$in> ) {
+            last if $Limit && $n >= $Limit;
+            next if $n++ % $Workers != $worker;
+
+            my $req = _parse_line( $line ) or next;
+            my $url = $base . $req->{PATH} . ( $req->{QS} || '' );
+
+            ### only send what the original request sent
+            my %headers;
+            for( [ 'X-Forwarded-For' => 'XFF' ], [ 'DNT' => 'DNT' ],
+                 [ 'Cookie' => 'IncomingCookie' ]
+            ) {
+                my( $header, $field ) = @$_;
+                $headers{ $header } = $req->{ $field }
+                    if defined $req->{ $field } && $req->{ $field } ne '-';
+            }
+
+            my $start = time;
+            my $res   = $http->get( $url, { headers => \%headers } );
+            my $time  = time - $start;
+
+            my $notes = $res->{headers}{ lc $NotesHeader };
+            my @vals  = map { _normalize( $res->{headers}{ lc $_ }, $notes ) } @Headers;
+
+            print $out join( "\t", $n, $res->{status}, sprintf( '%.6f', $time ),
+                             ( $notes ? 1 : 0 ), @vals ), "\n";
+
+            warn "[$worker] $url => $res->{status}\n" if $Debug;
+        }
+    }
+
+    close $out;
+}
+
+sub _result_file {
+    my( $idx, $worker ) = @_;
+    return "$TmpDir/build$idx.worker$worker";
+}
+
+### Log values are escaped by Apache: \" \\ and \xhh
+sub _parse_line {
+    my $line = shift;
+    my %rv;
+
+    while( $line =~ /"(\w+)":"((?:[^"\\]|\\.)*)"/g ) {
+        my( $key, $val ) = ( $1, $2 );
+
+        $val =~ s/\\x([0-9a-fA-F]{2})/chr hex $1/ge;
+        $val =~ s/\\(.)/$1/g;
+
+        $rv{ $key } = $val;
+    }
+
+    return defined $rv{PATH} ? \%rv : undef;
+}
+
+### A UID generated on this request differs between builds by design, so
+### it's masked, in whatever format it is; the notes header tells us which
+### one it was. Cookies the client sent back are compared as is. Expiry
+### dates depend on when the request was made, except the fixed DNT one.
+sub _normalize {
+    my $val   = shift;
+    my $notes = shift;
+    return '-' unless defined $val;
+
+    $val = join ', ', @$val if ref $val;
+
+    if( $notes && $notes =~ /\buid=(\S+)/ ) {
+        my $uid = $1;
+        $val =~ s/\Q$uid\E/<GENERATED>/g if $notes =~ /\bgenerated=1\b/;
+    }
+
+    $val =~ s/expires=(?!Fri, 01-Jan-38)[^;,]+(?:,[^;,]+)?/expires=<DATE>/gi;
+    $val =~ s/max-age=\d+/max-age=<AGE>/gi;
+    $val =~ s/[\t\n]/ /g;
+
+    return $val;
+}
+
+### Compare the results of two builds, request by request
+sub _compare {
+    my( $x, $y ) = @_;
+    my $diffs = 0;
+
+    for my $worker ( 0 .. $Workers - 1 ) {
+        open my $fa, '<', _result_file( $x, $worker ) or die $!;
+        open my $fb, '<', _result_file( $y, $worker ) or die $!;
+
+        while( defined( my $la = <$fa> ) ) {
+            my $lb = <$fb>;
+            last unless defined $lb;
+
+            chomp( $la, $lb );
+            my @a = split /\t/, $la, -1;
+            my @b = split /\t/, $lb, -1;
+
+            ### neither the time taken nor whether the notes header was
+            ### there is a difference itself
+            splice @a, 2, 2;
+            splice @b, 2, 2;
+            next if join( "\t", @a ) eq join( "\t", @b );
+
+            $diffs++;
+            next if $diffs > $MaxDiffs;
+
+            my @names = ( 'Request', 'Status', @Headers );
+            for my $i ( 1 .. $#names ) {
+                next if $a[$i] eq $b[$i];
+                printf "request %d %s:\n  build %d: %s\n  build %d: %s\n",
+                    $a[0], $names[$i], $x, $a[$i], $y, $b[$i];
+            }
+        }
+    }
+
+    printf "build %d vs build %d: %d requests differ\n", $x, $y, $diffs;
+
+    return $diffs;
+}
+
+sub usage {
+    return qq[
+  $0 --base http://host:port --base http://host:port [--base ...]
+      [--workers NUM] [--header Name ...] [--notes-header Name]
+      [--limit NUM] [--diffs NUM] [--debug] log...
+
+    \n];
+}